@@ -63,12 +63,23 @@ static inline void blkio_policy_insert_node(struct blkio_cgroup *blkcg,
 	list_add(&pn->node, &blkcg->policy_list);
 }
 
+/*
+ * FIOPS groups are weighted and accounted through the proportional weight
+ * cgroup files; only the policy callbacks are kept apart from CFQ's.
+ */
+static inline enum blkio_policy_id blkio_file_plid(enum blkio_policy_id plid)
+{
+	if (plid == BLKIO_POLICY_FIOPS)
+		return BLKIO_POLICY_PROP;
+	return plid;
+}
+
 static inline bool cftype_blkg_same_policy(struct cftype *cft,
 			struct blkio_group *blkg)
 {
 	enum blkio_policy_id plid = BLKIOFILE_POLICY(cft->private);
 
-	if (blkg->plid == plid)
+	if (blkio_file_plid(blkg->plid) == plid)
 		return 1;
 
 	return 0;
@@ -1051,7 +1062,8 @@ static void blkio_update_policy_node_blkg(struct blkio_cgroup *blkcg,
 	spin_lock_irq(&blkcg->lock);
 
 	hlist_for_each_entry(blkg, n, &blkcg->blkg_list, blkcg_node) {
-		if (pn->dev != blkg->dev || pn->plid != blkg->plid)
+		if (pn->dev != blkg->dev ||
+		    pn->plid != blkio_file_plid(blkg->plid))
 			continue;
 		blkio_update_blkg_policy(blkcg, blkg, pn);
 	}
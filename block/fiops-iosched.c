@@ -11,6 +11,7 @@
 #include <linux/rbtree.h>
 #include <linux/ioprio.h>
 #include "blk.h"
+#include "blk-cgroup.h"
 
 #define VIOS_SCALE_SHIFT 10
 #define VIOS_SCALE (1 << VIOS_SCALE_SHIFT)
@@ -38,10 +39,39 @@ enum wl_prio_t {
 	FIOPS_PRIO_NR,
 };
 
+/* This is per cgroup per device grouping structure */
+struct fiops_group {
+	/* group service_tree member */
+	struct rb_node rb_node;
+
+	/* group service_tree key, vios scaled by the group weight */
+	u64 vios;
+	unsigned int weight;
+	unsigned int new_weight;
+	bool needs_update;
+
+	/* number of busy iocs in this group */
+	unsigned int nr_busy;
+
+	struct fiops_rb_root service_tree[FIOPS_PRIO_NR];
+
+	/* requests dispatched and unscaled vios charged, see group_stats */
+	u64 dispatched;
+	u64 charged_vios;
+
+	struct blkio_group blkg;
+#ifdef CONFIG_FIOPS_GROUP_IOSCHED
+	struct hlist_node fiopsd_node;
+	int ref;
+#endif
+};
+
 struct fiops_data {
 	struct request_queue *queue;
 
-	struct fiops_rb_root service_tree[FIOPS_PRIO_NR];
+	/* Root service tree for fiops_groups */
+	struct fiops_rb_root grp_service_tree;
+	struct fiops_group root_group;
 
 	unsigned int busy_queues;
 	unsigned int in_flight[2];
@@ -52,6 +82,12 @@ struct fiops_data {
 	unsigned int write_scale;
 	unsigned int sync_scale;
 	unsigned int async_scale;
+
+	/* List of fiops groups being managed on this device */
+	struct hlist_head group_list;
+
+	/* Number of groups which are on blkcg->blkg_list */
+	unsigned int nr_blkcg_linked_grps;
 };
 
 struct fiops_ioc {
@@ -59,6 +95,7 @@ struct fiops_ioc {
 
 	unsigned int flags;
 	struct fiops_data *fiopsd;
+	struct fiops_group *fiopsg;
 	struct rb_node rb_node;
 	u64 vios; /* key in service_tree */
 	struct fiops_rb_root *service_tree;
@@ -73,7 +110,7 @@ struct fiops_ioc {
 	enum wl_prio_t wl_type;
 };
 
-#define ioc_service_tree(ioc) (&((ioc)->fiopsd->service_tree[(ioc)->wl_type]))
+#define ioc_service_tree(ioc) (&((ioc)->fiopsg->service_tree[(ioc)->wl_type]))
 #define RQ_CIC(rq)		icq_to_cic((rq)->elv.icq)
 
 enum ioc_state_flags {
@@ -173,6 +210,343 @@ static void fiops_update_min_vios(struct fiops_rb_root *service_tree)
 	service_tree->min_vios = max_vios(service_tree->min_vios, ioc->vios);
 }
 
+static struct fiops_group *fiops_rb_first_group(struct fiops_rb_root *root)
+{
+	/* Service tree is empty */
+	if (!root->count)
+		return NULL;
+
+	if (!root->left)
+		root->left = rb_first(&root->rb);
+
+	if (root->left)
+		return rb_entry(root->left, struct fiops_group, rb_node);
+
+	return NULL;
+}
+
+static void fiops_update_min_group_vios(struct fiops_rb_root *service_tree)
+{
+	struct fiops_group *fiopsg;
+
+	fiopsg = fiops_rb_first_group(service_tree);
+	if (!fiopsg)
+		return;
+	service_tree->min_vios = max_vios(service_tree->min_vios,
+					  fiopsg->vios);
+}
+
+/*
+ * A group with the default weight is charged the vios its iocs consumed,
+ * heavier groups proportionally less.
+ */
+static inline u64 fiops_group_scaled_vios(struct fiops_group *fiopsg, u64 vios)
+{
+	return div_u64(vios * BLKIO_WEIGHT_DEFAULT, fiopsg->weight);
+}
+
+static void __fiops_group_service_tree_add(struct fiops_rb_root *st,
+	struct fiops_group *fiopsg)
+{
+	struct rb_node **p = &st->rb.rb_node;
+	struct rb_node *parent = NULL;
+	struct fiops_group *__fiopsg;
+	int left = 1;
+
+	/* weight updates from the cgroup side take effect here */
+	if (fiopsg->needs_update) {
+		fiopsg->weight = fiopsg->new_weight;
+		fiopsg->needs_update = false;
+	}
+
+	while (*p) {
+		parent = *p;
+		__fiopsg = rb_entry(parent, struct fiops_group, rb_node);
+
+		if (fiopsg->vios < __fiopsg->vios)
+			p = &parent->rb_left;
+		else {
+			p = &parent->rb_right;
+			left = 0;
+		}
+	}
+
+	if (left)
+		st->left = &fiopsg->rb_node;
+
+	rb_link_node(&fiopsg->rb_node, parent, p);
+	rb_insert_color(&fiopsg->rb_node, &st->rb);
+	st->count++;
+}
+
+/*
+ * A group that becomes busy again starts no earlier than the groups already
+ * competing, so it cannot bank the time it spent idle as credit.
+ */
+static void fiops_group_service_tree_add(struct fiops_data *fiopsd,
+	struct fiops_group *fiopsg)
+{
+	struct fiops_rb_root *st = &fiopsd->grp_service_tree;
+
+	fiopsg->vios = max_vios(st->min_vios, fiopsg->vios);
+	__fiops_group_service_tree_add(st, fiopsg);
+	fiops_update_min_group_vios(st);
+}
+
+static void fiops_group_service_tree_del(struct fiops_data *fiopsd,
+	struct fiops_group *fiopsg)
+{
+	fiops_rb_erase(&fiopsg->rb_node, &fiopsd->grp_service_tree);
+}
+
+#ifdef CONFIG_FIOPS_GROUP_IOSCHED
+static inline void
+fiops_blkiocg_update_dispatch_stats(struct fiops_group *fiopsg,
+	struct request *rq)
+{
+	blkiocg_update_dispatch_stats(&fiopsg->blkg, blk_rq_bytes(rq),
+				      rq_data_dir(rq), rq_is_sync(rq));
+}
+
+static inline void
+fiops_blkiocg_update_completion_stats(struct fiops_group *fiopsg,
+	struct request *rq)
+{
+	blkiocg_update_completion_stats(&fiopsg->blkg, rq_start_time_ns(rq),
+					rq_io_start_time_ns(rq),
+					rq_data_dir(rq), rq_is_sync(rq));
+}
+
+static inline struct fiops_group *fiopsg_of_blkg(struct blkio_group *blkg)
+{
+	if (blkg)
+		return container_of(blkg, struct fiops_group, blkg);
+	return NULL;
+}
+
+static void fiops_update_blkio_group_weight(void *key, struct blkio_group *blkg,
+					    unsigned int weight)
+{
+	struct fiops_group *fiopsg = fiopsg_of_blkg(blkg);
+
+	fiopsg->new_weight = weight;
+	fiopsg->needs_update = true;
+}
+
+static void fiops_init_add_group_lists(struct fiops_data *fiopsd,
+	struct fiops_group *fiopsg, struct blkio_cgroup *blkcg)
+{
+	struct backing_dev_info *bdi = &fiopsd->queue->backing_dev_info;
+	unsigned int major, minor;
+
+	/*
+	 * bdi->dev might not be initialized yet, the device is filled in
+	 * by fiops_find_group() once it is.
+	 */
+	if (bdi->dev) {
+		sscanf(dev_name(bdi->dev), "%u:%u", &major, &minor);
+		blkiocg_add_blkio_group(blkcg, &fiopsg->blkg, (void *)fiopsd,
+					MKDEV(major, minor),
+					BLKIO_POLICY_FIOPS);
+	} else
+		blkiocg_add_blkio_group(blkcg, &fiopsg->blkg, (void *)fiopsd,
+					0, BLKIO_POLICY_FIOPS);
+
+	fiopsd->nr_blkcg_linked_grps++;
+	fiopsg->weight = blkcg_get_weight(blkcg, fiopsg->blkg.dev);
+
+	/* Add group on fiopsd list */
+	hlist_add_head(&fiopsg->fiopsd_node, &fiopsd->group_list);
+}
+
+/*
+ * Should be called from sleepable context, alloc_percpu() of the group
+ * stats might block.
+ */
+static struct fiops_group *fiops_alloc_group(struct fiops_data *fiopsd)
+{
+	struct fiops_group *fiopsg;
+	int i;
+
+	fiopsg = kzalloc_node(sizeof(*fiopsg), GFP_ATOMIC, fiopsd->queue->node);
+	if (!fiopsg)
+		return NULL;
+
+	for (i = IDLE_WORKLOAD; i <= RT_WORKLOAD; i++)
+		fiopsg->service_tree[i] = FIOPS_RB_ROOT;
+	RB_CLEAR_NODE(&fiopsg->rb_node);
+
+	/*
+	 * The initial reference is shared by the cgroup and the elevator and
+	 * dropped by whichever of the two goes away first.
+	 */
+	fiopsg->ref = 1;
+
+	if (blkio_alloc_blkg_stats(&fiopsg->blkg)) {
+		kfree(fiopsg);
+		return NULL;
+	}
+
+	return fiopsg;
+}
+
+static struct fiops_group *
+fiops_find_group(struct fiops_data *fiopsd, struct blkio_cgroup *blkcg)
+{
+	struct fiops_group *fiopsg;
+	struct backing_dev_info *bdi = &fiopsd->queue->backing_dev_info;
+	unsigned int major, minor;
+
+	/* Avoid the lookup in the common case of no blkio cgroups */
+	if (blkcg == &blkio_root_cgroup)
+		fiopsg = &fiopsd->root_group;
+	else
+		fiopsg = fiopsg_of_blkg(blkiocg_lookup_group(blkcg, fiopsd));
+
+	if (fiopsg && !fiopsg->blkg.dev && bdi->dev && dev_name(bdi->dev)) {
+		sscanf(dev_name(bdi->dev), "%u:%u", &major, &minor);
+		fiopsg->blkg.dev = MKDEV(major, minor);
+	}
+
+	return fiopsg;
+}
+
+/*
+ * Search for the fiops group current task belongs to. request_queue lock
+ * must be held, it is dropped around the allocation of a new group.
+ */
+static struct fiops_group *fiops_get_group(struct fiops_data *fiopsd)
+{
+	struct blkio_cgroup *blkcg;
+	struct fiops_group *fiopsg, *__fiopsg;
+	struct request_queue *q = fiopsd->queue;
+
+	rcu_read_lock();
+	blkcg = task_blkio_cgroup(current);
+	fiopsg = fiops_find_group(fiopsd, blkcg);
+	rcu_read_unlock();
+	if (fiopsg)
+		return fiopsg;
+
+	spin_unlock_irq(q->queue_lock);
+	fiopsg = fiops_alloc_group(fiopsd);
+	spin_lock_irq(q->queue_lock);
+
+	rcu_read_lock();
+	blkcg = task_blkio_cgroup(current);
+
+	/* somebody else might have added the group while we slept */
+	__fiopsg = fiops_find_group(fiopsd, blkcg);
+	if (__fiopsg) {
+		if (fiopsg) {
+			free_percpu(fiopsg->blkg.stats_cpu);
+			kfree(fiopsg);
+		}
+		rcu_read_unlock();
+		return __fiopsg;
+	}
+
+	if (fiopsg)
+		fiops_init_add_group_lists(fiopsd, fiopsg, blkcg);
+	else
+		fiopsg = &fiopsd->root_group;
+	rcu_read_unlock();
+	return fiopsg;
+}
+
+static inline struct fiops_group *
+fiops_ref_get_group(struct fiops_group *fiopsg)
+{
+	fiopsg->ref++;
+	return fiopsg;
+}
+
+static void fiops_put_group(struct fiops_group *fiopsg)
+{
+	int i;
+
+	BUG_ON(fiopsg->ref <= 0);
+	fiopsg->ref--;
+	if (fiopsg->ref)
+		return;
+	for (i = IDLE_WORKLOAD; i <= RT_WORKLOAD; i++)
+		BUG_ON(!RB_EMPTY_ROOT(&fiopsg->service_tree[i].rb));
+	free_percpu(fiopsg->blkg.stats_cpu);
+	kfree(fiopsg);
+}
+
+static void fiops_destroy_group(struct fiops_data *fiopsd,
+	struct fiops_group *fiopsg)
+{
+	/* Something wrong if we are trying to remove same group twice */
+	BUG_ON(hlist_unhashed(&fiopsg->fiopsd_node));
+
+	hlist_del_init(&fiopsg->fiopsd_node);
+
+	BUG_ON(fiopsd->nr_blkcg_linked_grps <= 0);
+	fiopsd->nr_blkcg_linked_grps--;
+
+	/*
+	 * Put the reference taken at the time of creation so that the group
+	 * goes away together with the last ioc linked to it.
+	 */
+	fiops_put_group(fiopsg);
+}
+
+static void fiops_release_groups(struct fiops_data *fiopsd)
+{
+	struct hlist_node *pos, *n;
+	struct fiops_group *fiopsg;
+
+	hlist_for_each_entry_safe(fiopsg, pos, n, &fiopsd->group_list,
+				  fiopsd_node) {
+		/*
+		 * If the cgroup removal path got to the blkio_group first, it
+		 * takes care of destroying the group as well.
+		 */
+		if (!blkiocg_del_blkio_group(&fiopsg->blkg))
+			fiops_destroy_group(fiopsd, fiopsg);
+	}
+}
+
+/*
+ * The blkio cgroup is going away, so no new IO will come in this group.
+ * Called under rcu_read_lock(), "key" is a valid fiops_data for as long.
+ */
+static void fiops_unlink_blkio_group(void *key, struct blkio_group *blkg)
+{
+	unsigned long flags;
+	struct fiops_data *fiopsd = key;
+
+	spin_lock_irqsave(fiopsd->queue->queue_lock, flags);
+	fiops_destroy_group(fiopsd, fiopsg_of_blkg(blkg));
+	spin_unlock_irqrestore(fiopsd->queue->queue_lock, flags);
+}
+
+#else /* FIOPS_GROUP_IOSCHED */
+static inline void
+fiops_blkiocg_update_dispatch_stats(struct fiops_group *fiopsg,
+	struct request *rq) {}
+static inline void
+fiops_blkiocg_update_completion_stats(struct fiops_group *fiopsg,
+	struct request *rq) {}
+
+static struct fiops_group *fiops_get_group(struct fiops_data *fiopsd)
+{
+	return &fiopsd->root_group;
+}
+
+static inline struct fiops_group *
+fiops_ref_get_group(struct fiops_group *fiopsg)
+{
+	return fiopsg;
+}
+
+static inline void fiops_put_group(struct fiops_group *fiopsg) {}
+static void fiops_release_groups(struct fiops_data *fiopsd) {}
+
+#endif /* FIOPS_GROUP_IOSCHED */
+
 /*
  * The fiopsd->service_trees holds all pending fiops_ioc's that have
  * requests waiting to be processed. It is sorted in the order that
@@ -257,6 +631,8 @@ static void fiops_add_ioc_rr(struct fiops_data *fiopsd, struct fiops_ioc *ioc)
 	fiops_mark_ioc_on_rr(ioc);
 
 	fiopsd->busy_queues++;
+	if (!ioc->fiopsg->nr_busy++)
+		fiops_group_service_tree_add(fiopsd, ioc->fiopsg);
 
 	fiops_resort_rr_list(fiopsd, ioc);
 }
@@ -275,10 +651,44 @@ static void fiops_del_ioc_rr(struct fiops_data *fiopsd, struct fiops_ioc *ioc)
 		ioc->service_tree = NULL;
 	}
 
+	BUG_ON(!ioc->fiopsg->nr_busy);
+	if (!--ioc->fiopsg->nr_busy)
+		fiops_group_service_tree_del(fiopsd, ioc->fiopsg);
+
 	BUG_ON(!fiopsd->busy_queues);
 	fiopsd->busy_queues--;
 }
 
+/*
+ * Move @ioc, together with any requests it has queued, into the group of
+ * the current task. The queue lock might be dropped while the group is
+ * looked up.
+ */
+static void fiops_link_ioc_group(struct fiops_data *fiopsd,
+	struct fiops_ioc *ioc)
+{
+	struct fiops_group *fiopsg = fiops_get_group(fiopsd);
+	bool on_rr;
+
+	if (fiopsg == ioc->fiopsg)
+		return;
+
+	on_rr = fiops_ioc_on_rr(ioc);
+	if (on_rr)
+		fiops_del_ioc_rr(fiopsd, ioc);
+
+	if (ioc->fiopsg) {
+		fiops_put_group(ioc->fiopsg);
+		ioc->fiopsg = fiops_ref_get_group(fiopsg);
+		/* vios of different service trees are not comparable */
+		ioc->vios = ioc_service_tree(ioc)->min_vios;
+	} else
+		ioc->fiopsg = fiops_ref_get_group(fiopsg);
+
+	if (on_rr)
+		fiops_add_ioc_rr(fiopsd, ioc);
+}
+
 /*
  * rb tree support functions
  */
@@ -343,25 +753,31 @@ static u64 fiops_dispatch_request(struct fiops_data *fiopsd,
 	fiopsd->in_flight[rq_is_sync(rq)]++;
 	ioc->in_flight++;
 
+	ioc->fiopsg->dispatched++;
+	fiops_blkiocg_update_dispatch_stats(ioc->fiopsg, rq);
+
 	return fiops_scaled_vios(fiopsd, ioc, rq);
 }
 
 static int fiops_forced_dispatch(struct fiops_data *fiopsd)
 {
+	struct fiops_group *fiopsg;
 	struct fiops_ioc *ioc;
 	int dispatched = 0;
 	int i;
 
-	for (i = RT_WORKLOAD; i >= IDLE_WORKLOAD; i--) {
-		while (!RB_EMPTY_ROOT(&fiopsd->service_tree[i].rb)) {
-			ioc = fiops_rb_first(&fiopsd->service_tree[i]);
-
-			while (!list_empty(&ioc->fifo)) {
-				fiops_dispatch_request(fiopsd, ioc);
-				dispatched++;
+	while ((fiopsg = fiops_rb_first_group(&fiopsd->grp_service_tree))) {
+		for (i = RT_WORKLOAD; i >= IDLE_WORKLOAD; i--) {
+			while (!RB_EMPTY_ROOT(&fiopsg->service_tree[i].rb)) {
+				ioc = fiops_rb_first(&fiopsg->service_tree[i]);
+
+				while (!list_empty(&ioc->fifo)) {
+					fiops_dispatch_request(fiopsd, ioc);
+					dispatched++;
+				}
+				if (fiops_ioc_on_rr(ioc))
+					fiops_del_ioc_rr(fiopsd, ioc);
 			}
-			if (fiops_ioc_on_rr(ioc))
-				fiops_del_ioc_rr(fiopsd, ioc);
 		}
 	}
 	return dispatched;
@@ -369,14 +785,20 @@ static int fiops_forced_dispatch(struct fiops_data *fiopsd)
 
 static struct fiops_ioc *fiops_select_ioc(struct fiops_data *fiopsd)
 {
+	struct fiops_group *fiopsg;
 	struct fiops_ioc *ioc;
 	struct fiops_rb_root *service_tree = NULL;
 	int i;
 	struct request *rq;
 
+	/* the group that received the least weighted service goes first */
+	fiopsg = fiops_rb_first_group(&fiopsd->grp_service_tree);
+	if (!fiopsg)
+		return NULL;
+
 	for (i = RT_WORKLOAD; i >= IDLE_WORKLOAD; i--) {
-		if (!RB_EMPTY_ROOT(&fiopsd->service_tree[i].rb)) {
-			service_tree = &fiopsd->service_tree[i];
+		if (!RB_EMPTY_ROOT(&fiopsg->service_tree[i].rb)) {
+			service_tree = &fiopsg->service_tree[i];
 			break;
 		}
 	}
@@ -393,12 +815,31 @@ static struct fiops_ioc *fiops_select_ioc(struct fiops_data *fiopsd)
 	 * to be starved, don't delay
 	 */
 	if (!rq_is_sync(rq) && fiopsd->in_flight[1] != 0 &&
-			service_tree->count == 1)
+			service_tree->count == 1 &&
+			fiopsd->grp_service_tree.count == 1)
 		return NULL;
 
 	return ioc;
 }
 
+static void fiops_charge_group_vios(struct fiops_data *fiopsd,
+	struct fiops_group *fiopsg, u64 vios)
+{
+	struct fiops_rb_root *st = &fiopsd->grp_service_tree;
+
+	/* a busy group has to be resorted with its new key */
+	if (fiopsg->nr_busy)
+		fiops_rb_erase(&fiopsg->rb_node, st);
+
+	fiopsg->vios += fiops_group_scaled_vios(fiopsg, vios);
+	fiopsg->charged_vios += vios;
+
+	if (fiopsg->nr_busy)
+		__fiops_group_service_tree_add(st, fiopsg);
+
+	fiops_update_min_group_vios(st);
+}
+
 static void fiops_charge_vios(struct fiops_data *fiopsd,
 	struct fiops_ioc *ioc, u64 vios)
 {
@@ -411,6 +852,8 @@ static void fiops_charge_vios(struct fiops_data *fiopsd,
 		fiops_resort_rr_list(fiopsd, ioc);
 
 	fiops_update_min_vios(service_tree);
+
+	fiops_charge_group_vios(fiopsd, ioc->fiopsg, vios);
 }
 
 static int fiops_dispatch_requests(struct request_queue *q, int force)
@@ -498,6 +941,8 @@ static void fiops_completed_request(struct request_queue *q, struct request *rq)
 	fiopsd->in_flight[rq_is_sync(rq)]--;
 	ioc->in_flight--;
 
+	fiops_blkiocg_update_completion_stats(ioc->fiopsg, rq);
+
 	if (fiopsd->in_flight[0] + fiopsd->in_flight[1] == 0)
 		fiops_schedule_dispatch(fiopsd);
 }
@@ -580,9 +1025,29 @@ static int fiops_allow_merge(struct request_queue *q, struct request *rq,
 static void fiops_exit_queue(struct elevator_queue *e)
 {
 	struct fiops_data *fiopsd = e->elevator_data;
+	struct request_queue *q = fiopsd->queue;
+	bool wait = false;
 
 	cancel_work_sync(&fiopsd->unplug_work);
 
+	spin_lock_irq(q->queue_lock);
+	fiops_release_groups(fiopsd);
+
+	/*
+	 * Groups the cgroup removal path claimed first might still be looked
+	 * up through blkg->key, wait a rcu period for them.
+	 */
+	if (fiopsd->nr_blkcg_linked_grps)
+		wait = true;
+	spin_unlock_irq(q->queue_lock);
+
+	if (wait)
+		synchronize_rcu();
+
+#ifdef CONFIG_FIOPS_GROUP_IOSCHED
+	/* Free up per cpu stats for root group */
+	free_percpu(fiopsd->root_group.blkg.stats_cpu);
+#endif
 	kfree(fiopsd);
 }
 
@@ -600,6 +1065,7 @@ static void fiops_kick_queue(struct work_struct *work)
 static void *fiops_init_queue(struct request_queue *q)
 {
 	struct fiops_data *fiopsd;
+	struct fiops_group *fiopsg;
 	int i;
 
 	fiopsd = kzalloc_node(sizeof(*fiopsd), GFP_KERNEL, q->node);
@@ -608,8 +1074,38 @@ static void *fiops_init_queue(struct request_queue *q)
 
 	fiopsd->queue = q;
 
+	fiopsd->grp_service_tree = FIOPS_RB_ROOT;
+
+	/* Init root group */
+	fiopsg = &fiopsd->root_group;
 	for (i = IDLE_WORKLOAD; i <= RT_WORKLOAD; i++)
-		fiopsd->service_tree[i] = FIOPS_RB_ROOT;
+		fiopsg->service_tree[i] = FIOPS_RB_ROOT;
+	RB_CLEAR_NODE(&fiopsg->rb_node);
+
+	/* Give preference to root group over other groups */
+	fiopsg->weight = 2 * BLKIO_WEIGHT_DEFAULT;
+
+#ifdef CONFIG_FIOPS_GROUP_IOSCHED
+	/*
+	 * One reference is dropped by fiops_release_groups(), the other one
+	 * stays as the root group is freed together with fiops_data.
+	 */
+	fiopsg->ref = 2;
+
+	if (blkio_alloc_blkg_stats(&fiopsg->blkg)) {
+		kfree(fiopsd);
+		return NULL;
+	}
+
+	rcu_read_lock();
+	blkiocg_add_blkio_group(&blkio_root_cgroup, &fiopsg->blkg,
+				(void *)fiopsd, 0, BLKIO_POLICY_FIOPS);
+	rcu_read_unlock();
+	fiopsd->nr_blkcg_linked_grps++;
+
+	/* Add group on fiopsd->group_list */
+	hlist_add_head(&fiopsg->fiopsd_node, &fiopsd->group_list);
+#endif
 
 	INIT_WORK(&fiopsd->unplug_work, fiops_kick_queue);
 
@@ -636,6 +1132,35 @@ static void fiops_init_icq(struct io_cq *icq)
 	fiops_mark_ioc_prio_changed(ioc);
 }
 
+static void fiops_exit_icq(struct io_cq *icq)
+{
+	struct fiops_ioc *ioc = icq_to_cic(icq);
+
+	if (ioc->fiopsg)
+		fiops_put_group(ioc->fiopsg);
+}
+
+/*
+ * Find the group of the submitting task here rather than at insert time,
+ * a new group has to be allocated from sleepable context.
+ */
+static int
+fiops_set_request(struct request_queue *q, struct request *rq, gfp_t gfp_mask)
+{
+	struct fiops_data *fiopsd = q->elevator->elevator_data;
+	struct fiops_ioc *ioc = icq_to_cic(rq->elv.icq);
+
+	might_sleep_if(gfp_mask & __GFP_WAIT);
+
+	spin_lock_irq(q->queue_lock);
+	if (unlikely(!ioc->fiopsg) ||
+	    test_and_clear_bit(ICQ_CGROUP_CHANGED, &ioc->icq.changed))
+		fiops_link_ioc_group(fiopsd, ioc);
+	spin_unlock_irq(q->queue_lock);
+
+	return 0;
+}
+
 /*
  * sysfs parts below -->
  */
@@ -685,14 +1210,56 @@ STORE_FUNCTION(fiops_sync_scale_store, &fiopsd->sync_scale, 1, 100);
 STORE_FUNCTION(fiops_async_scale_store, &fiopsd->async_scale, 1, 100);
 #undef STORE_FUNCTION
 
+static int fiops_group_stats_print(struct fiops_group *fiopsg, char *page,
+	size_t len)
+{
+	char *path = blkg_path(&fiopsg->blkg);
+
+	/* the root group is not linked to a cgroup without group support */
+	if (!path || !*path)
+		path = "/";
+
+	return scnprintf(page, len, "%s %u %llu %llu\n", path,
+			 fiopsg->weight,
+			 (unsigned long long)fiopsg->dispatched,
+			 (unsigned long long)fiopsg->charged_vios);
+}
+
+/* one "<cgroup> <weight> <dispatched> <vios>" line per group */
+static ssize_t fiops_group_stats_show(struct elevator_queue *e, char *page)
+{
+	struct fiops_data *fiopsd = e->elevator_data;
+	struct request_queue *q = fiopsd->queue;
+	ssize_t len = 0;
+#ifdef CONFIG_FIOPS_GROUP_IOSCHED
+	struct fiops_group *fiopsg;
+	struct hlist_node *pos;
+#endif
+
+	spin_lock_irq(q->queue_lock);
+#ifdef CONFIG_FIOPS_GROUP_IOSCHED
+	hlist_for_each_entry(fiopsg, pos, &fiopsd->group_list, fiopsd_node)
+		len += fiops_group_stats_print(fiopsg, page + len,
+					       PAGE_SIZE - len);
+#else
+	len = fiops_group_stats_print(&fiopsd->root_group, page, PAGE_SIZE);
+#endif
+	spin_unlock_irq(q->queue_lock);
+
+	return len;
+}
+
 #define FIOPS_ATTR(name) \
 	__ATTR(name, S_IRUGO|S_IWUSR, fiops_##name##_show, fiops_##name##_store)
+#define FIOPS_RO_ATTR(name) \
+	__ATTR(name, S_IRUGO, fiops_##name##_show, NULL)
 
 static struct elv_fs_entry fiops_attrs[] = {
 	FIOPS_ATTR(read_scale),
 	FIOPS_ATTR(write_scale),
 	FIOPS_ATTR(sync_scale),
 	FIOPS_ATTR(async_scale),
+	FIOPS_RO_ATTR(group_stats),
 	__ATTR_NULL
 };
 
@@ -708,6 +1275,8 @@ static struct elevator_type iosched_fiops = {
 		.elevator_former_req_fn =	elv_rb_former_request,
 		.elevator_latter_req_fn =	elv_rb_latter_request,
 		.elevator_init_icq_fn =		fiops_init_icq,
+		.elevator_exit_icq_fn =		fiops_exit_icq,
+		.elevator_set_req_fn =		fiops_set_request,
 		.elevator_init_fn =		fiops_init_queue,
 		.elevator_exit_fn =		fiops_exit_queue,
 	},
@@ -718,13 +1287,36 @@ static struct elevator_type iosched_fiops = {
 	.elevator_owner =	THIS_MODULE,
 };
 
+#ifdef CONFIG_FIOPS_GROUP_IOSCHED
+static struct blkio_policy_type blkio_policy_fiops = {
+	.ops = {
+		.blkio_unlink_group_fn =	fiops_unlink_blkio_group,
+		.blkio_update_group_weight_fn =	fiops_update_blkio_group_weight,
+	},
+	.plid = BLKIO_POLICY_FIOPS,
+};
+#endif
+
 static int __init fiops_init(void)
 {
-	return elv_register(&iosched_fiops);
+	int ret;
+
+	ret = elv_register(&iosched_fiops);
+	if (ret)
+		return ret;
+
+#ifdef CONFIG_FIOPS_GROUP_IOSCHED
+	blkio_policy_register(&blkio_policy_fiops);
+#endif
+
+	return 0;
 }
 
 static void __exit fiops_exit(void)
 {
+#ifdef CONFIG_FIOPS_GROUP_IOSCHED
+	blkio_policy_unregister(&blkio_policy_fiops);
+#endif
 	elv_unregister(&iosched_fiops);
 }
 
@@ -26,6 +26,7 @@
 #include <linux/compiler.h>
 #include <linux/blktrace_api.h>
 #include <linux/hrtimer.h>
+#include <linux/math64.h>
 
 /*
  * enum row_queue_prio - Priorities of the ROW queues
@@ -99,6 +100,15 @@ static const struct row_queue_params row_queues_def[] = {
 #define ROW_IDLE_TIME_MSEC 5
 #define ROW_READ_FREQ_MSEC 5
 
+/*
+ * Default read latency target (in usec) the quantums are adapted to, and
+ * how far above their configured value the adapted quantums may grow.
+ */
+#define ROW_READ_LAT_TARGET_USEC	10000
+#define ROW_QUANTUM_MAX_SCALE		8
+/* Service time samples above this (in usec) are clipped */
+#define ROW_SVC_TIME_MAX_USEC		USEC_PER_SEC
+
 /**
  * struct rowq_idling_data -  parameters for idling on the queue
  * @last_insert_time:	time the last request was inserted
@@ -119,8 +129,10 @@ struct rowq_idling_data {
  * @nr_dispatched:	number of requests already dispatched in
  *			the current dispatch cycle
  * @nr_req:		number of requests in queue
+ * @quantum:		configured dispatch quantum
  * @dispatch quantum:	number of requests this queue may
- *			dispatch in a dispatch cycle
+ *			dispatch in a dispatch cycle, adapted from
+ *			@quantum to the measured service times
  * @idle_data:		data for idling on queues
  *
  */
@@ -132,6 +144,7 @@ struct row_queue {
 	unsigned int		nr_dispatched;
 
 	unsigned int		nr_req;
+	int			quantum;
 	int			disp_quantum;
 
 	/* used only for READ queues */
@@ -171,6 +184,19 @@ struct starvation_data {
 	int				starvation_counter;
 };
 
+/**
+ * struct svc_time_data - data for adapting the dispatch quantums
+ * @read_lat_target_us:	read latency (usec) the quantums are adapted
+ *			to meet, 0 to use the configured quantums as is
+ * @est_us:		moving estimate of the service time (usec) of
+ *			READ (est_us[0]) and WRITE (est_us[1]) requests
+ *
+ */
+struct svc_time_data {
+	int				read_lat_target_us;
+	unsigned int			est_us[2];
+};
+
 /**
  * struct row_queue - Per block device rqueue structure
  * @dispatch_queue:	dispatch rqueue
@@ -186,6 +212,7 @@ struct starvation_data {
  * @last_served_ioprio_class: I/O priority class that was last dispatched from
  * @reg_prio_starvation: starvation data for REGULAR priority queues
  * @low_prio_starvation: starvation data for LOW priority queues
+ * @svc_time:		data for adapting the dispatch quantums
  * @cycle_flags:	used for marking unserved queueus
  *
  */
@@ -205,10 +232,15 @@ struct row_data {
 #define	ROW_LOW_STARVATION_TOLLERANCE	10000
 	struct starvation_data		low_prio_starvation;
 
+	struct svc_time_data		svc_time;
+
 	unsigned int			cycle_flags;
 };
 
 #define RQ_ROWQ(rq) ((struct row_queue *) ((rq)->elv.priv[0]))
+/* Dispatch time of a request (usec), for measuring its service time */
+#define RQ_DISP_TIME(rq) ((unsigned long) ((rq)->elv.priv[1]))
+#define RQ_SET_DISP_TIME(rq, t) ((rq)->elv.priv[1] = (void *) (t))
 
 #define row_log(q, fmt, args...)   \
 	blk_add_trace_msg(q, "%s():" fmt , __func__, ##args)
@@ -234,6 +266,12 @@ static inline int row_rowq_unserved(struct row_data *rd,
 	return rd->cycle_flags & (1 << qnum);
 }
 
+static inline bool row_rowq_is_read(enum row_queue_prio qnum)
+{
+	return qnum == ROWQ_PRIO_HIGH_READ || qnum == ROWQ_PRIO_REG_READ ||
+		qnum == ROWQ_PRIO_LOW_READ;
+}
+
 static inline void __maybe_unused row_dump_queues_stat(struct row_data *rd)
 {
 	int i;
@@ -455,10 +493,36 @@ static int row_reinsert_req(struct request_queue *q,
 	return 0;
 }
 
+/*
+ * row_update_svc_time() - Fold the service time of a completed request
+ *			   into the estimate for its direction
+ * @rd:		pointer to struct row_data
+ * @rq:		the completed request
+ *
+ * The estimate is a moving average giving each new sample a weight of 1/8.
+ */
+static void row_update_svc_time(struct row_data *rd, struct request *rq)
+{
+	unsigned int *est = &rd->svc_time.est_us[rq_data_dir(rq)];
+	unsigned long svc_us;
+
+	svc_us = (unsigned long)ktime_to_us(ktime_get()) - RQ_DISP_TIME(rq);
+	svc_us = min_t(unsigned long, svc_us, ROW_SVC_TIME_MAX_USEC);
+	if (!svc_us)
+		svc_us = 1;
+
+	if (!*est)
+		*est = svc_us;
+	else
+		*est = (*est * 7 + svc_us) / 8;
+}
+
 static void row_completed_req(struct request_queue *q, struct request *rq)
 {
 	struct row_data *rd = q->elevator->elevator_data;
 
+	row_update_svc_time(rd, rq);
+
 	 if (rq->cmd_flags & REQ_URGENT) {
 		if (!rd->urgent_in_flight) {
 			WARN_ON(1);
@@ -530,6 +594,7 @@ static void row_dispatch_insert(struct row_data *rd, struct request *rq)
 	struct row_queue *rqueue = RQ_ROWQ(rq);
 
 	row_remove_request(rd, rq);
+	RQ_SET_DISP_TIME(rq, (unsigned long)ktime_to_us(ktime_get()));
 	elv_dispatch_sort(rd->dispatch_queue, rq);
 	if (rq->cmd_flags & REQ_URGENT) {
 		WARN_ON(rd->urgent_in_flight);
@@ -660,6 +725,65 @@ done:
 	return ret;
 }
 
+/*
+ * row_adapt_quantum() - Set the dispatch quantums of a priority class for
+ *			 the next dispatch cycle
+ * @rd:		pointer to struct row_data
+ * @start_idx/end_idx: indexes in the row_queues array of the class
+ *
+ * A READ arriving while the WRITE queues of its class are served waits for
+ * their whole quantum. The WRITE quantum is therefore sized to what fits in
+ * the read latency target next to the READ's own service time. If even the
+ * configured WRITE quantum does not fit, the READ quantum is grown instead,
+ * so that the writes are spread over more reads. The quantums never drop
+ * below their configured values, which are used as is until both service
+ * time estimates are known or if no target is set.
+ */
+static void row_adapt_quantum(struct row_data *rd, int start_idx, int end_idx)
+{
+	u64 rd_cost = rd->svc_time.est_us[READ];
+	u64 wr_cost = rd->svc_time.est_us[WRITE];
+	u64 target = max(rd->svc_time.read_lat_target_us, 0);
+	u64 slack, wr_base = 0, wr_quantum;
+	struct row_queue *rqueue;
+	int i;
+
+	for (i = start_idx; i < end_idx; i++) {
+		rqueue = &rd->row_queues[i];
+		rqueue->disp_quantum = rqueue->quantum;
+		if (!row_rowq_is_read(i))
+			wr_base += rqueue->quantum;
+	}
+
+	if (!target || !rd_cost || !wr_cost || !wr_base)
+		return;
+
+	slack = target > rd_cost ? target - rd_cost : 1;
+	wr_quantum = clamp_t(u64, div64_u64(slack, wr_cost), wr_base,
+			     wr_base * ROW_QUANTUM_MAX_SCALE);
+
+	for (i = start_idx; i < end_idx; i++) {
+		u64 quantum;
+
+		rqueue = &rd->row_queues[i];
+		if (!row_rowq_is_read(i))
+			quantum = div64_u64(wr_quantum * rqueue->quantum,
+					    wr_base);
+		else if (wr_quantum * wr_cost > slack)
+			quantum = min_t(u64, div64_u64(rqueue->quantum *
+					wr_quantum * wr_cost, slack),
+					(u64)rqueue->quantum *
+					ROW_QUANTUM_MAX_SCALE);
+		else
+			continue;
+		rqueue->disp_quantum = clamp_t(u64, quantum, 1, INT_MAX);
+		row_log_rowq(rd, i, "quantum %d (read %uus, write %uus)",
+			     rqueue->disp_quantum,
+			     rd->svc_time.est_us[READ],
+			     rd->svc_time.est_us[WRITE]);
+	}
+}
+
 static void row_restart_cycle(struct row_data *rd,
 				int start_idx, int end_idx)
 {
@@ -672,6 +796,7 @@ static void row_restart_cycle(struct row_data *rd,
 			row_mark_rowq_unserved(rd, i);
 		rd->row_queues[i].nr_dispatched = 0;
 	}
+	row_adapt_quantum(rd, start_idx, end_idx);
 	row_log(rd->dispatch_queue, "Restarting cycle for class @ %d-%d",
 		start_idx, end_idx);
 }
@@ -802,6 +927,7 @@ static void *row_init_queue(struct request_queue *q)
 	memset(rdata, 0, sizeof(*rdata));
 	for (i = 0; i < ROWQ_MAX_PRIO; i++) {
 		INIT_LIST_HEAD(&rdata->row_queues[i].fifo);
+		rdata->row_queues[i].quantum = row_queues_def[i].quantum;
 		rdata->row_queues[i].disp_quantum = row_queues_def[i].quantum;
 		rdata->row_queues[i].rdata = rdata;
 		rdata->row_queues[i].prio = i;
@@ -814,6 +940,7 @@ static void *row_init_queue(struct request_queue *q)
 			ROW_REG_STARVATION_TOLLERANCE;
 	rdata->low_prio_starvation.starvation_limit =
 			ROW_LOW_STARVATION_TOLLERANCE;
+	rdata->svc_time.read_lat_target_us = ROW_READ_LAT_TARGET_USEC;
 	/*
 	 * Currently idling is enabled only for READ queues. If we want to
 	 * enable it for write queues also, note that idling frequency will
@@ -971,25 +1098,28 @@ static ssize_t __FUNC(struct elevator_queue *e, char *page)		\
 	return row_var_show(__data, (page));			\
 }
 SHOW_FUNCTION(row_hp_read_quantum_show,
-	rowd->row_queues[ROWQ_PRIO_HIGH_READ].disp_quantum);
+	rowd->row_queues[ROWQ_PRIO_HIGH_READ].quantum);
 SHOW_FUNCTION(row_rp_read_quantum_show,
-	rowd->row_queues[ROWQ_PRIO_REG_READ].disp_quantum);
+	rowd->row_queues[ROWQ_PRIO_REG_READ].quantum);
 SHOW_FUNCTION(row_hp_swrite_quantum_show,
-	rowd->row_queues[ROWQ_PRIO_HIGH_SWRITE].disp_quantum);
+	rowd->row_queues[ROWQ_PRIO_HIGH_SWRITE].quantum);
 SHOW_FUNCTION(row_rp_swrite_quantum_show,
-	rowd->row_queues[ROWQ_PRIO_REG_SWRITE].disp_quantum);
+	rowd->row_queues[ROWQ_PRIO_REG_SWRITE].quantum);
 SHOW_FUNCTION(row_rp_write_quantum_show,
-	rowd->row_queues[ROWQ_PRIO_REG_WRITE].disp_quantum);
+	rowd->row_queues[ROWQ_PRIO_REG_WRITE].quantum);
 SHOW_FUNCTION(row_lp_read_quantum_show,
-	rowd->row_queues[ROWQ_PRIO_LOW_READ].disp_quantum);
+	rowd->row_queues[ROWQ_PRIO_LOW_READ].quantum);
 SHOW_FUNCTION(row_lp_swrite_quantum_show,
-	rowd->row_queues[ROWQ_PRIO_LOW_SWRITE].disp_quantum);
+	rowd->row_queues[ROWQ_PRIO_LOW_SWRITE].quantum);
 SHOW_FUNCTION(row_rd_idle_data_show, rowd->rd_idle_data.idle_time_ms);
 SHOW_FUNCTION(row_rd_idle_data_freq_show, rowd->rd_idle_data.freq_ms);
 SHOW_FUNCTION(row_reg_starv_limit_show,
 	rowd->reg_prio_starvation.starvation_limit);
 SHOW_FUNCTION(row_low_starv_limit_show,
 	rowd->low_prio_starvation.starvation_limit);
+SHOW_FUNCTION(row_read_lat_target_show, rowd->svc_time.read_lat_target_us);
+SHOW_FUNCTION(row_read_svc_time_show, rowd->svc_time.est_us[READ]);
+SHOW_FUNCTION(row_write_svc_time_show, rowd->svc_time.est_us[WRITE]);
 #undef SHOW_FUNCTION
 
 #define STORE_FUNCTION(__FUNC, __PTR, MIN, MAX)			\
@@ -1007,24 +1137,24 @@ static ssize_t __FUNC(struct elevator_queue *e,				\
 	return ret;							\
 }
 STORE_FUNCTION(row_hp_read_quantum_store,
-&rowd->row_queues[ROWQ_PRIO_HIGH_READ].disp_quantum, 1, INT_MAX);
+&rowd->row_queues[ROWQ_PRIO_HIGH_READ].quantum, 1, INT_MAX);
 STORE_FUNCTION(row_rp_read_quantum_store,
-			&rowd->row_queues[ROWQ_PRIO_REG_READ].disp_quantum,
+			&rowd->row_queues[ROWQ_PRIO_REG_READ].quantum,
 			1, INT_MAX);
 STORE_FUNCTION(row_hp_swrite_quantum_store,
-			&rowd->row_queues[ROWQ_PRIO_HIGH_SWRITE].disp_quantum,
+			&rowd->row_queues[ROWQ_PRIO_HIGH_SWRITE].quantum,
 			1, INT_MAX);
 STORE_FUNCTION(row_rp_swrite_quantum_store,
-			&rowd->row_queues[ROWQ_PRIO_REG_SWRITE].disp_quantum,
+			&rowd->row_queues[ROWQ_PRIO_REG_SWRITE].quantum,
 			1, INT_MAX);
 STORE_FUNCTION(row_rp_write_quantum_store,
-			&rowd->row_queues[ROWQ_PRIO_REG_WRITE].disp_quantum,
+			&rowd->row_queues[ROWQ_PRIO_REG_WRITE].quantum,
 			1, INT_MAX);
 STORE_FUNCTION(row_lp_read_quantum_store,
-			&rowd->row_queues[ROWQ_PRIO_LOW_READ].disp_quantum,
+			&rowd->row_queues[ROWQ_PRIO_LOW_READ].quantum,
 			1, INT_MAX);
 STORE_FUNCTION(row_lp_swrite_quantum_store,
-			&rowd->row_queues[ROWQ_PRIO_LOW_SWRITE].disp_quantum,
+			&rowd->row_queues[ROWQ_PRIO_LOW_SWRITE].quantum,
 			1, INT_MAX);
 STORE_FUNCTION(row_rd_idle_data_store, &rowd->rd_idle_data.idle_time_ms,
 			1, INT_MAX);
@@ -1036,12 +1166,16 @@ STORE_FUNCTION(row_reg_starv_limit_store,
 STORE_FUNCTION(row_low_starv_limit_store,
 			&rowd->low_prio_starvation.starvation_limit,
 			1, INT_MAX);
+STORE_FUNCTION(row_read_lat_target_store,
+			&rowd->svc_time.read_lat_target_us, 0, INT_MAX);
 
 #undef STORE_FUNCTION
 
 #define ROW_ATTR(name) \
 	__ATTR(name, S_IRUGO|S_IWUSR, row_##name##_show, \
 				      row_##name##_store)
+#define ROW_RO_ATTR(name) \
+	__ATTR(name, S_IRUGO, row_##name##_show, NULL)
 
 static struct elv_fs_entry row_attrs[] = {
 	ROW_ATTR(hp_read_quantum),
@@ -1055,6 +1189,9 @@ static struct elv_fs_entry row_attrs[] = {
 	ROW_ATTR(rd_idle_data_freq),
 	ROW_ATTR(reg_starv_limit),
 	ROW_ATTR(low_starv_limit),
+	ROW_ATTR(read_lat_target),
+	ROW_RO_ATTR(read_svc_time),
+	ROW_RO_ATTR(write_svc_time),
 	__ATTR_NULL
 };
 
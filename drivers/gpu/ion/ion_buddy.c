@@ -0,0 +1,273 @@
+/*
+ * drivers/gpu/ion/ion_buddy.c
+ *
+ * Copyright (C) 2013 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <linux/err.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+#include "ion_priv.h"
+
+static void ion_buddy_add_free(struct ion_buddy *buddy, unsigned long idx,
+			       unsigned int order)
+{
+	struct ion_buddy_block *block = &buddy->blocks[idx];
+
+	block->order = order;
+	block->free = true;
+	list_add(&block->list, &buddy->free_list[order]);
+	buddy->nr_free[order]++;
+}
+
+static void ion_buddy_del_free(struct ion_buddy *buddy, unsigned long idx)
+{
+	struct ion_buddy_block *block = &buddy->blocks[idx];
+
+	block->free = false;
+	list_del(&block->list);
+	buddy->nr_free[block->order]--;
+}
+
+static void ion_buddy_free_block(struct ion_buddy *buddy, unsigned long idx,
+				 unsigned int order)
+{
+	while (order < buddy->max_order) {
+		unsigned long buddy_idx = idx ^ (1UL << order);
+		struct ion_buddy_block *block;
+
+		/* the last buddy in a range that is not a power of two */
+		if (buddy_idx + (1UL << order) > buddy->nr_blocks)
+			break;
+		block = &buddy->blocks[buddy_idx];
+		if (!block->free || block->order != order)
+			break;
+		ion_buddy_del_free(buddy, buddy_idx);
+		idx &= ~(1UL << order);
+		order++;
+	}
+	ion_buddy_add_free(buddy, idx, order);
+}
+
+/*
+ * Free an arbitrary run of minimum-sized blocks by splitting it into the
+ * largest naturally aligned blocks it contains.
+ */
+static void ion_buddy_free_range(struct ion_buddy *buddy, unsigned long idx,
+				 unsigned long count)
+{
+	buddy->free_blocks += count;
+	while (count) {
+		unsigned int order = min_t(unsigned int, ilog2(count),
+					   buddy->max_order);
+
+		if (idx)
+			order = min_t(unsigned int, order, __ffs(idx));
+		ion_buddy_free_block(buddy, idx, order);
+		idx += 1UL << order;
+		count -= 1UL << order;
+	}
+}
+
+/*
+ * Slow path for requests the free lists cannot serve: larger than the
+ * largest block, or only fitting in adjacent free blocks that are not
+ * buddies.  Walk the range for a run of free blocks long enough and carve
+ * the request out of it, handing back what is left on either side.
+ */
+static bool ion_buddy_alloc_run(struct ion_buddy *buddy, unsigned long count,
+				unsigned long align, unsigned long *start)
+{
+	unsigned long idx = 0, run_start = 0, run_end = 0;
+
+	while (idx < buddy->nr_blocks) {
+		struct ion_buddy_block *block = &buddy->blocks[idx];
+
+		if (!block->free) {
+			idx++;
+			continue;
+		}
+		if (idx != run_end)
+			run_start = idx;
+		run_end = idx + (1UL << block->order);
+		idx = run_end;
+		*start = ALIGN(run_start, align);
+		if (*start + count <= run_end)
+			goto found;
+	}
+	return false;
+
+found:
+	for (idx = run_start; idx < run_end;
+	     idx += 1UL << buddy->blocks[idx].order)
+		ion_buddy_del_free(buddy, idx);
+	buddy->free_blocks -= run_end - run_start;
+	ion_buddy_free_range(buddy, run_start, *start - run_start);
+	ion_buddy_free_range(buddy, *start + count, run_end - *start - count);
+	return true;
+}
+
+/* longest run of adjacent free blocks, what a single request can get */
+static unsigned long ion_buddy_largest_run(struct ion_buddy *buddy)
+{
+	unsigned long idx = 0, run_start = 0, run_end = 0, largest = 0;
+
+	while (idx < buddy->nr_blocks) {
+		struct ion_buddy_block *block = &buddy->blocks[idx];
+
+		if (!block->free) {
+			idx++;
+			continue;
+		}
+		if (idx != run_end)
+			run_start = idx;
+		run_end = idx + (1UL << block->order);
+		idx = run_end;
+		largest = max(largest, run_end - run_start);
+	}
+	return largest;
+}
+
+ion_phys_addr_t ion_buddy_alloc(struct ion_buddy *buddy, unsigned long size,
+				unsigned long align)
+{
+	unsigned long count, idx;
+	unsigned int order, align_order = 0, i;
+	struct ion_buddy_block *block;
+
+	count = ALIGN(size, 1UL << buddy->min_shift) >> buddy->min_shift;
+	if (!count || count > buddy->nr_blocks)
+		return ION_CARVEOUT_ALLOCATE_FAIL;
+	if (align > (1UL << buddy->min_shift))
+		align_order = order_base_2(align >> buddy->min_shift);
+	order = max_t(unsigned int, order_base_2(count), align_order);
+
+	spin_lock(&buddy->lock);
+	for (i = order; i <= buddy->max_order; i++)
+		if (!list_empty(&buddy->free_list[i]))
+			break;
+	if (i > buddy->max_order) {
+		if (!ion_buddy_alloc_run(buddy, count, 1UL << align_order,
+					 &idx)) {
+			buddy->failures++;
+			spin_unlock(&buddy->lock);
+			return ION_CARVEOUT_ALLOCATE_FAIL;
+		}
+		spin_unlock(&buddy->lock);
+		return buddy->base + ((ion_phys_addr_t)idx << buddy->min_shift);
+	}
+
+	block = list_first_entry(&buddy->free_list[i], struct ion_buddy_block,
+				 list);
+	idx = block - buddy->blocks;
+	ion_buddy_del_free(buddy, idx);
+	while (i > order) {
+		i--;
+		ion_buddy_add_free(buddy, idx + (1UL << i), i);
+	}
+
+	/* hand back the part of the block the request does not need */
+	buddy->free_blocks -= 1UL << order;
+	if (count < (1UL << order))
+		ion_buddy_free_range(buddy, idx + count,
+				     (1UL << order) - count);
+	spin_unlock(&buddy->lock);
+
+	return buddy->base + ((ion_phys_addr_t)idx << buddy->min_shift);
+}
+
+void ion_buddy_free(struct ion_buddy *buddy, ion_phys_addr_t addr,
+		    unsigned long size)
+{
+	unsigned long idx = (addr - buddy->base) >> buddy->min_shift;
+	unsigned long count = ALIGN(size, 1UL << buddy->min_shift) >>
+			      buddy->min_shift;
+
+	if (WARN_ON(addr < buddy->base || idx + count > buddy->nr_blocks))
+		return;
+
+	spin_lock(&buddy->lock);
+	ion_buddy_free_range(buddy, idx, count);
+	spin_unlock(&buddy->lock);
+}
+
+void ion_buddy_debug_show(struct ion_buddy *buddy, struct seq_file *s)
+{
+	unsigned long nr_free[ION_BUDDY_MAX_ORDER + 1];
+	unsigned long free, largest, failures;
+	unsigned long block_size = 1UL << buddy->min_shift;
+	int i;
+
+	spin_lock(&buddy->lock);
+	memcpy(nr_free, buddy->nr_free, sizeof(nr_free));
+	free = buddy->free_blocks;
+	failures = buddy->failures;
+	largest = ion_buddy_largest_run(buddy);
+	spin_unlock(&buddy->lock);
+
+	seq_printf(s, "%16s %16lu\n", "total", buddy->nr_blocks * block_size);
+	seq_printf(s, "%16s %16lu\n", "free", free * block_size);
+	seq_printf(s, "%16s %16lu\n", "largest free", largest * block_size);
+	/* share of the free space that a single allocation cannot reach */
+	seq_printf(s, "%16s %15lu%%\n", "fragmentation",
+		   free ? 100 - largest * 100 / free : 0);
+	seq_printf(s, "%16s %16lu\n", "failed allocs", failures);
+	seq_printf(s, "\n%16s %16s\n", "block size", "free blocks");
+	for (i = 0; i <= buddy->max_order; i++)
+		seq_printf(s, "%16lu %16lu\n", block_size << i, nr_free[i]);
+}
+
+struct ion_buddy *ion_buddy_create(ion_phys_addr_t base, size_t size,
+				   unsigned int min_shift)
+{
+	struct ion_buddy *buddy;
+	int i;
+
+	if (size < (1UL << min_shift))
+		return ERR_PTR(-EINVAL);
+
+	buddy = kzalloc(sizeof(struct ion_buddy), GFP_KERNEL);
+	if (!buddy)
+		return ERR_PTR(-ENOMEM);
+	buddy->base = base;
+	buddy->min_shift = min_shift;
+	buddy->nr_blocks = size >> min_shift;
+	buddy->max_order = min_t(unsigned int, ilog2(buddy->nr_blocks),
+				 ION_BUDDY_MAX_ORDER);
+	buddy->blocks = vzalloc(buddy->nr_blocks *
+				sizeof(struct ion_buddy_block));
+	if (!buddy->blocks) {
+		kfree(buddy);
+		return ERR_PTR(-ENOMEM);
+	}
+	spin_lock_init(&buddy->lock);
+	for (i = 0; i <= ION_BUDDY_MAX_ORDER; i++)
+		INIT_LIST_HEAD(&buddy->free_list[i]);
+	ion_buddy_free_range(buddy, 0, buddy->nr_blocks);
+
+	return buddy;
+}
+
+void ion_buddy_destroy(struct ion_buddy *buddy)
+{
+	if (buddy->free_blocks != buddy->nr_blocks)
+		pr_err("%s: destroying allocator with %lu blocks in use\n",
+		       __func__, buddy->nr_blocks - buddy->free_blocks);
+	vfree(buddy->blocks);
+	kfree(buddy);
+}
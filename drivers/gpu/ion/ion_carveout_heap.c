@@ -16,11 +16,11 @@
 #include <linux/spinlock.h>
 
 #include <linux/err.h>
-#include <linux/genalloc.h>
 #include <linux/io.h>
 #include <linux/ion.h>
 #include <linux/mm.h>
 #include <linux/scatterlist.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
 #include "ion_priv.h"
@@ -29,7 +29,7 @@
 
 struct ion_carveout_heap {
 	struct ion_heap heap;
-	struct gen_pool *pool;
+	struct ion_buddy *buddy;
 	ion_phys_addr_t base;
 };
 
@@ -39,12 +39,8 @@ ion_phys_addr_t ion_carveout_allocate(struct ion_heap *heap,
 {
 	struct ion_carveout_heap *carveout_heap =
 		container_of(heap, struct ion_carveout_heap, heap);
-	unsigned long offset = gen_pool_alloc(carveout_heap->pool, size);
 
-	if (!offset)
-		return ION_CARVEOUT_ALLOCATE_FAIL;
-
-	return offset;
+	return ion_buddy_alloc(carveout_heap->buddy, size, align);
 }
 
 void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
@@ -55,7 +51,7 @@ void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
 
 	if (addr == ION_CARVEOUT_ALLOCATE_FAIL)
 		return;
-	gen_pool_free(carveout_heap->pool, addr, size);
+	ion_buddy_free(carveout_heap->buddy, addr, size);
 }
 
 static int ion_carveout_heap_phys(struct ion_heap *heap,
@@ -138,6 +134,16 @@ int ion_carveout_heap_map_user(struct ion_heap *heap, struct ion_buffer *buffer,
 			       pgprot_noncached(vma->vm_page_prot));
 }
 
+static int ion_carveout_heap_debug_show(struct ion_heap *heap,
+					struct seq_file *s, void *unused)
+{
+	struct ion_carveout_heap *carveout_heap =
+		container_of(heap, struct ion_carveout_heap, heap);
+
+	ion_buddy_debug_show(carveout_heap->buddy, s);
+	return 0;
+}
+
 static struct ion_heap_ops carveout_heap_ops = {
 	.allocate = ion_carveout_heap_allocate,
 	.free = ion_carveout_heap_free,
@@ -157,16 +163,18 @@ struct ion_heap *ion_carveout_heap_create(struct ion_platform_heap *heap_data)
 	if (!carveout_heap)
 		return ERR_PTR(-ENOMEM);
 
-	carveout_heap->pool = gen_pool_create(12, -1);
-	if (!carveout_heap->pool) {
+	carveout_heap->buddy = ion_buddy_create(heap_data->base, heap_data->size,
+						PAGE_SHIFT);
+	if (IS_ERR(carveout_heap->buddy)) {
+		struct ion_buddy *buddy = carveout_heap->buddy;
+
 		kfree(carveout_heap);
-		return ERR_PTR(-ENOMEM);
+		return ERR_CAST(buddy);
 	}
 	carveout_heap->base = heap_data->base;
-	gen_pool_add(carveout_heap->pool, carveout_heap->base, heap_data->size,
-		     -1);
 	carveout_heap->heap.ops = &carveout_heap_ops;
 	carveout_heap->heap.type = ION_HEAP_TYPE_CARVEOUT;
+	carveout_heap->heap.debug_show = ion_carveout_heap_debug_show;
 
 	return &carveout_heap->heap;
 }
@@ -176,7 +184,7 @@ void ion_carveout_heap_destroy(struct ion_heap *heap)
 	struct ion_carveout_heap *carveout_heap =
 	     container_of(heap, struct  ion_carveout_heap, heap);
 
-	gen_pool_destroy(carveout_heap->pool);
+	ion_buddy_destroy(carveout_heap->buddy);
 	kfree(carveout_heap);
 	carveout_heap = NULL;
 }
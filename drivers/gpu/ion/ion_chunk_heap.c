@@ -16,11 +16,11 @@
 //#include <linux/spinlock.h>
 #include <linux/dma-mapping.h>
 #include <linux/err.h>
-#include <linux/genalloc.h>
 #include <linux/io.h>
 #include <linux/ion.h>
 #include <linux/mm.h>
 #include <linux/scatterlist.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
 #include "ion_priv.h"
@@ -29,7 +29,7 @@
 
 struct ion_chunk_heap {
 	struct ion_heap heap;
-	struct gen_pool *pool;
+	struct ion_buddy *buddy;
 	ion_phys_addr_t base;
 	unsigned long chunk_size;
 	unsigned long size;
@@ -69,9 +69,10 @@ static int ion_chunk_heap_allocate(struct ion_heap *heap,
 
 	sg = table->sgl;
 	for (i = 0; i < num_chunks; i++) {
-		unsigned long paddr = gen_pool_alloc(chunk_heap->pool,
-						     chunk_heap->chunk_size);
-		if (!paddr)
+		ion_phys_addr_t paddr = ion_buddy_alloc(chunk_heap->buddy,
+							chunk_heap->chunk_size,
+							0);
+		if (paddr == ION_CARVEOUT_ALLOCATE_FAIL)
 			goto err;
 		sg_set_page(sg, phys_to_page(paddr), chunk_heap->chunk_size, 0);
 		sg = sg_next(sg);
@@ -83,8 +84,8 @@ static int ion_chunk_heap_allocate(struct ion_heap *heap,
 err:
 	sg = table->sgl;
 	for (i -= 1; i >= 0; i--) {
-		gen_pool_free(chunk_heap->pool, page_to_phys(sg_page(sg)),
-			      sg_dma_len(sg));
+		ion_buddy_free(chunk_heap->buddy, page_to_phys(sg_page(sg)),
+			       sg_dma_len(sg));
 		sg = sg_next(sg);
 	}
 	sg_free_table(table);
@@ -107,8 +108,8 @@ static void ion_chunk_heap_free(struct ion_buffer *buffer)
 		if (ion_buffer_cached(buffer))
 			__dma_page_cpu_to_dev(sg_page(sg), 0, sg_dma_len(sg),
 					      DMA_BIDIRECTIONAL);
-		gen_pool_free(chunk_heap->pool, page_to_phys(sg_page(sg)),
-			      sg_dma_len(sg));
+		ion_buddy_free(chunk_heap->buddy, page_to_phys(sg_page(sg)),
+			       sg_dma_len(sg));
 	}
 	chunk_heap->allocated -= buffer->size;
 	sg_free_table(table);
@@ -127,6 +128,18 @@ void ion_chunk_heap_unmap_dma(struct ion_heap *heap,
 	return;
 }
 
+static int ion_chunk_heap_debug_show(struct ion_heap *heap,
+				     struct seq_file *s, void *unused)
+{
+	struct ion_chunk_heap *chunk_heap =
+		container_of(heap, struct ion_chunk_heap, heap);
+
+	seq_printf(s, "%16s %16lu\n", "chunk size", chunk_heap->chunk_size);
+	seq_printf(s, "%16s %16lu\n", "allocated", chunk_heap->allocated);
+	ion_buddy_debug_show(chunk_heap->buddy, s);
+	return 0;
+}
+
 static struct ion_heap_ops chunk_heap_ops = {
 	.allocate = ion_chunk_heap_allocate,
 	.free = ion_chunk_heap_free,
@@ -150,11 +163,12 @@ struct ion_heap *ion_chunk_heap_create(struct ion_platform_heap *heap_data)
 		return ERR_PTR(-ENOMEM);
 
 	chunk_heap->chunk_size = (unsigned long)heap_data->priv;
-	chunk_heap->pool = gen_pool_create(get_order(chunk_heap->chunk_size) +
-					   PAGE_SHIFT, -1);
-	if (!chunk_heap->pool) {
-		ret = -ENOMEM;
-		goto error_gen_pool_create;
+	chunk_heap->buddy = ion_buddy_create(heap_data->base, heap_data->size,
+					     get_order(chunk_heap->chunk_size) +
+					     PAGE_SHIFT);
+	if (IS_ERR(chunk_heap->buddy)) {
+		ret = PTR_ERR(chunk_heap->buddy);
+		goto error_buddy_create;
 	}
 	chunk_heap->base = heap_data->base;
 	chunk_heap->size = heap_data->size;
@@ -179,10 +193,10 @@ struct ion_heap *ion_chunk_heap_create(struct ion_platform_heap *heap_data)
 
 	__dma_page_cpu_to_dev(phys_to_page(heap_data->base), 0, heap_data->size,
 			      DMA_BIDIRECTIONAL);
-	gen_pool_add(chunk_heap->pool, chunk_heap->base, heap_data->size, -1);
 	chunk_heap->heap.ops = &chunk_heap_ops;
 	chunk_heap->heap.type = ION_HEAP_TYPE_CHUNK;
 	chunk_heap->heap.flags = ION_HEAP_FLAG_DEFER_FREE;
+	chunk_heap->heap.debug_show = ion_chunk_heap_debug_show;
 	pr_info("%s: base %lu size %u align %ld\n", __func__, chunk_heap->base,
 		heap_data->size, heap_data->align);
 
@@ -191,8 +205,8 @@ struct ion_heap *ion_chunk_heap_create(struct ion_platform_heap *heap_data)
 error_map_vm_area:
 	free_vm_area(vm_struct);
 error:
-	gen_pool_destroy(chunk_heap->pool);
-error_gen_pool_create:
+	ion_buddy_destroy(chunk_heap->buddy);
+error_buddy_create:
 	kfree(chunk_heap);
 	return ERR_PTR(ret);
 }
@@ -202,7 +216,7 @@ void ion_chunk_heap_destroy(struct ion_heap *heap)
 	struct ion_chunk_heap *chunk_heap =
 	     container_of(heap, struct  ion_chunk_heap, heap);
 
-	gen_pool_destroy(chunk_heap->pool);
+	ion_buddy_destroy(chunk_heap->buddy);
 	kfree(chunk_heap);
 	chunk_heap = NULL;
 }
@@ -17,9 +17,13 @@
 #include <linux/debugfs.h>
 #include <linux/dma-mapping.h>
 #include <linux/err.h>
+#include <linux/freezer.h>
 #include <linux/fs.h>
+#include <linux/jiffies.h>
+#include <linux/kthread.h>
 #include <linux/list.h>
 #include <linux/module.h>
+#include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/mm.h>
 #include "ion_priv.h"
@@ -29,14 +33,30 @@
 static struct plist_head pools = PLIST_HEAD_INIT(pools);
 static struct shrinker shrinker;
 
+/*
+ * how long the refill threads stay away after the shrinker has run, and a
+ * pool's refill thread after it failed to get a page
+ */
+#define ION_PAGE_POOL_BACKOFF	(5 * HZ)
+
+/* last time the shrinker took pages from the pools */
+static unsigned long ion_page_pool_pressure = INITIAL_JIFFIES;
+
+/*
+ * Refills may only use memory that is free anyway: no reclaim, no kswapd,
+ * no dipping into the reserves.
+ */
+#define ION_PAGE_POOL_REFILL_GFP	(__GFP_NORETRY | __GFP_NOWARN | \
+					 __GFP_NO_KSWAPD | __GFP_NOMEMALLOC)
+
 struct ion_page_pool_item {
 	struct page *page;
 	struct list_head list;
 };
 
-static void *ion_page_pool_alloc_pages(struct ion_page_pool *pool)
+static void *ion_page_pool_alloc_pages(struct ion_page_pool *pool, gfp_t gfp)
 {
-	struct page *page = alloc_pages(pool->gfp_mask, pool->order);
+	struct page *page = alloc_pages(gfp, pool->order);
 
 	if (!page)
 		return NULL;
@@ -54,11 +74,12 @@ static void ion_page_pool_free_pages(struct ion_page_pool *pool,
 	__free_pages(page, pool->order);
 }
 
-static int ion_page_pool_add(struct ion_page_pool *pool, struct page *page)
+static int ion_page_pool_add(struct ion_page_pool *pool, struct page *page,
+			     gfp_t gfp)
 {
 	struct ion_page_pool_item *item;
 
-	item = kmalloc(sizeof(struct ion_page_pool_item), GFP_KERNEL);
+	item = kmalloc(sizeof(struct ion_page_pool_item), gfp);
 	if (!item)
 		return -ENOMEM;
 
@@ -98,6 +119,11 @@ static struct page *ion_page_pool_remove(struct ion_page_pool *pool, bool high)
 	return page;
 }
 
+static bool ion_page_pool_needs_refill(struct ion_page_pool *pool)
+{
+	return pool->high_count + pool->low_count < pool->watermark;
+}
+
 void *ion_page_pool_alloc(struct ion_page_pool *pool)
 {
 	struct page *page = NULL;
@@ -109,10 +135,17 @@ void *ion_page_pool_alloc(struct ion_page_pool *pool)
 		page = ion_page_pool_remove(pool, true);
 	else if (pool->low_count)
 		page = ion_page_pool_remove(pool, false);
+	if (page)
+		pool->hits++;
+	else
+		pool->misses++;
 	mutex_unlock(&pool->mutex);
 
+	if (pool->refill_task && ion_page_pool_needs_refill(pool))
+		wake_up(&pool->refill_wait);
+
 	if (!page)
-		page = ion_page_pool_alloc_pages(pool);
+		page = ion_page_pool_alloc_pages(pool, pool->gfp_mask);
 
 	return page;
 }
@@ -121,7 +154,7 @@ void ion_page_pool_free(struct ion_page_pool *pool, struct page* page)
 {
 	int ret;
 
-	ret = ion_page_pool_add(pool, page);
+	ret = ion_page_pool_add(pool, page, GFP_KERNEL);
 	if (ret)
 		ion_page_pool_free_pages(pool, page);
 }
@@ -169,9 +202,9 @@ static int debug_grow_pools_set(void *data, u64 val)
 	plist_for_each_entry(pool, &pools, list) {
 		if (val != pool->list.prio)
 			continue;
-		page = ion_page_pool_alloc_pages(pool);
+		page = ion_page_pool_alloc_pages(pool, pool->gfp_mask);
 		if (page)
-			ion_page_pool_add(pool, page);
+			ion_page_pool_add(pool, page, GFP_KERNEL);
 	}
 
 	return 0;
@@ -208,6 +241,9 @@ static int ion_page_pool_shrink(struct shrinker *shrinker,
 	if (nr_to_scan == 0)
 		return ion_page_pool_total(high);
 
+	/* keep the refill threads from undoing our work */
+	ion_page_pool_pressure = jiffies;
+
 	plist_for_each_entry(pool, &pools, list) {
 		for (i = 0; i < nr_to_scan; i++) {
 			struct page *page;
@@ -243,6 +279,14 @@ struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order)
 	INIT_LIST_HEAD(&pool->high_items);
 	pool->gfp_mask = gfp_mask;
 	pool->order = order;
+	pool->watermark = 0;
+	pool->refill_task = NULL;
+	init_waitqueue_head(&pool->refill_wait);
+	pool->hits = 0;
+	pool->misses = 0;
+	pool->refills = 0;
+	pool->backoffs = 0;
+	pool->refill_failed = jiffies - ION_PAGE_POOL_BACKOFF;
 	mutex_init(&pool->mutex);
 	plist_node_init(&pool->list, order);
 	plist_add(&pool->list, &pools);
@@ -250,8 +294,91 @@ struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order)
 	return pool;
 }
 
+/*
+ * ion_page_pool_refill - body of a pool's refill thread
+ *
+ * Runs at the lowest priority, and adds one item at a time, so that it
+ * never competes with the allocations it is trying to speed up.
+ */
+static int ion_page_pool_refill(void *data)
+{
+	struct ion_page_pool *pool = data;
+	gfp_t gfp = (pool->gfp_mask | ION_PAGE_POOL_REFILL_GFP) & ~__GFP_WAIT;
+
+	set_user_nice(current, 19);
+	set_freezable();
+
+	while (!kthread_should_stop()) {
+		unsigned long until;
+		struct page *page;
+
+		wait_event_freezable(pool->refill_wait,
+				     ion_page_pool_needs_refill(pool) ||
+				     kthread_should_stop());
+		if (kthread_should_stop())
+			break;
+
+		/*
+		 * A pool that cannot get its pages, say because high orders
+		 * are fragmented, only holds back itself.
+		 */
+		until = ACCESS_ONCE(ion_page_pool_pressure);
+		if (time_after(pool->refill_failed, until))
+			until = pool->refill_failed;
+		until += ION_PAGE_POOL_BACKOFF;
+		if (time_before(jiffies, until)) {
+			pool->backoffs++;
+			schedule_timeout_interruptible(until - jiffies);
+			continue;
+		}
+
+		page = ion_page_pool_alloc_pages(pool, gfp);
+		if (!page) {
+			pool->refill_failed = jiffies;
+			continue;
+		}
+		if (ion_page_pool_add(pool, page, GFP_NOWAIT | __GFP_NOWARN)) {
+			pool->refill_failed = jiffies;
+			ion_page_pool_free_pages(pool, page);
+			continue;
+		}
+		pool->refills++;
+		cond_resched();
+	}
+
+	return 0;
+}
+
+/**
+ * ion_page_pool_start_refill - keep a pool topped up in the background
+ * @pool:		the pool
+ * @watermark:		number of items to keep in it
+ *
+ * The pages added are allocated with the pool's gfp_mask, so they are
+ * zeroed if the pool's pages are.
+ */
+int ion_page_pool_start_refill(struct ion_page_pool *pool, int watermark)
+{
+	struct task_struct *task;
+
+	if (watermark <= 0)
+		return 0;
+
+	pool->watermark = watermark;
+	task = kthread_run(ion_page_pool_refill, pool, "ion_pool_%u",
+			   pool->order);
+	if (IS_ERR(task)) {
+		pool->watermark = 0;
+		return PTR_ERR(task);
+	}
+	pool->refill_task = task;
+	return 0;
+}
+
 void ion_page_pool_destroy(struct ion_page_pool *pool)
 {
+	if (pool->refill_task)
+		kthread_stop(pool->refill_task);
 	plist_del(&pool->list, &pools);
 	kfree(pool);
 }
@@ -23,6 +23,7 @@
 #include <linux/mutex.h>
 #include <linux/rbtree.h>
 #include <linux/sched.h>
+#include <linux/spinlock.h>
 #include <linux/mm.h>
 #include <linux/types.h>
 
@@ -238,6 +239,89 @@ void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
  */
 #define ION_CARVEOUT_ALLOCATE_FAIL -1
 
+/**
+ * functions for managing a physically contiguous range of memory with a
+ * binary buddy allocator -- used by the carveout and chunk heaps.
+ */
+
+#define ION_BUDDY_MAX_ORDER	20
+
+/**
+ * struct ion_buddy_block - per minimum-sized block metadata
+ * @list:		node in the free list for @order, valid while free
+ * @order:		order of the free block starting here
+ * @free:		true if a free block starts here
+ *
+ * Only the first minimum-sized block of a free block has @free set, so
+ * the buddy of a block being freed can be checked in constant time.
+ */
+struct ion_buddy_block {
+	struct list_head list;
+	unsigned char order;
+	bool free;
+};
+
+/**
+ * struct ion_buddy - buddy allocator state
+ * @lock:		protects the free lists and block metadata
+ * @base:		physical address of the managed range
+ * @min_shift:		log2 of the minimum block size
+ * @max_order:		largest block order, relative to the minimum block
+ * @nr_blocks:		number of minimum-sized blocks in the range
+ * @free_blocks:	number of free minimum-sized blocks
+ * @failures:		allocations that could not be satisfied
+ * @blocks:		metadata, one entry per minimum-sized block
+ * @free_list:		free blocks of each order
+ * @nr_free:		length of each free list
+ *
+ * Allocation and free are O(log n) in the size of the range: requests are
+ * served from the smallest non-empty free list at or above the order they
+ * need, splitting on the way down, and freed blocks are merged with their
+ * buddies on the way up.  The unused tail of a block rounded up to a power
+ * of two is handed back straight away, so a request only consumes its own
+ * size rounded up to the minimum block.
+ *
+ * Requests larger than the largest block, or that only fit in adjacent
+ * free blocks that are not buddies, fall back to a linear search for a
+ * run of free blocks, so anything a first-fit allocator could place is
+ * still served.  Blocks are indexed from @base, which needs no alignment
+ * beyond that of the heap it describes.
+ */
+struct ion_buddy {
+	spinlock_t lock;
+	ion_phys_addr_t base;
+	unsigned int min_shift;
+	unsigned int max_order;
+	unsigned long nr_blocks;
+	unsigned long free_blocks;
+	unsigned long failures;
+	struct ion_buddy_block *blocks;
+	struct list_head free_list[ION_BUDDY_MAX_ORDER + 1];
+	unsigned long nr_free[ION_BUDDY_MAX_ORDER + 1];
+};
+
+struct ion_buddy *ion_buddy_create(ion_phys_addr_t base, size_t size,
+				   unsigned int min_shift);
+void ion_buddy_destroy(struct ion_buddy *buddy);
+/**
+ * ion_buddy_alloc - allocate physically contiguous memory
+ * @buddy:		the allocator
+ * @size:		size of the allocation
+ * @align:		required alignment, relative to the base of the range
+ *
+ * returns the physical address, or ION_CARVEOUT_ALLOCATE_FAIL
+ */
+ion_phys_addr_t ion_buddy_alloc(struct ion_buddy *buddy, unsigned long size,
+				unsigned long align);
+void ion_buddy_free(struct ion_buddy *buddy, ion_phys_addr_t addr,
+		    unsigned long size);
+/**
+ * ion_buddy_debug_show - print a fragmentation report for a heap's debugfs
+ * file: free space, the largest free block and a histogram of free blocks
+ * by order.
+ */
+void ion_buddy_debug_show(struct ion_buddy *buddy, struct seq_file *s);
+
 /**
  * functions for creating and destroying a heap pool -- allows you
  * to keep a pool of pre allocated memory to use from your heap.  Keeping
@@ -261,11 +345,26 @@ void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
  * @gfp_mask:		gfp_mask to use from alloc
  * @order:		order of pages in the pool
  * @list:		plist node for list of pools
+ * @watermark:		number of items the refill thread keeps in the pool
+ * @refill_task:	the refill thread, or NULL if the pool has none
+ * @refill_wait:	wait queue the refill thread sleeps on while the pool
+ *			is at its watermark
+ * @hits:		allocations served from the pool
+ * @misses:		allocations that went to the page allocator
+ * @refills:		items added to the pool by the refill thread
+ * @backoffs:		times the refill thread backed off because memory
+ *			was short
+ * @refill_failed:	last time the refill thread failed to add an item
  *
  * Allows you to keep a pool of pre allocated pages to use from your heap.
  * Keeping a pool of pages that is ready for dma, ie any cached mapping have
  * been invalidated from the cache, provides a significant peformance benefit
  * on many systems
+ *
+ * A pool with a refill thread is kept topped up to its watermark with
+ * pre-zeroed pages in the background, so allocations do not have to wait
+ * for the page allocator. The thread backs off for a while whenever the
+ * shrinker has had to take pages back out of the pools.
  */
 struct ion_page_pool {
 	int high_count;
@@ -278,10 +377,19 @@ struct ion_page_pool {
 	gfp_t gfp_mask;
 	unsigned int order;
 	struct plist_node list;
+	int watermark;
+	struct task_struct *refill_task;
+	wait_queue_head_t refill_wait;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long refills;
+	unsigned long backoffs;
+	unsigned long refill_failed;
 };
 
 struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order);
 void ion_page_pool_destroy(struct ion_page_pool *);
+int ion_page_pool_start_refill(struct ion_page_pool *pool, int watermark);
 void *ion_page_pool_alloc(struct ion_page_pool *);
 void ion_page_pool_free(struct ion_page_pool *, struct page *);
 
@@ -20,6 +20,8 @@
 #include <linux/highmem.h>
 #include <linux/ion.h>
 #include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/scatterlist.h>
 #include <linux/seq_file.h>
 #include <linux/slab.h>
@@ -33,6 +35,16 @@ static unsigned int low_order_gfp_flags  = (GFP_HIGHUSER | __GFP_ZERO |
 					 __GFP_NOWARN);
 static const unsigned int orders[] = {8, 4, 0};
 static const int num_orders = ARRAY_SIZE(orders);
+
+/*
+ * Number of pre-zeroed items kept in each uncached page pool, per entry in
+ * orders[]: 4MB of order 8, 1MB of order 4 and 1MB of order 0 pages with
+ * 4K pages. 0 turns the background refill off for that order.
+ */
+static int pool_watermark[] = {4, 16, 256};
+module_param_array(pool_watermark, int, NULL, S_IRUGO);
+MODULE_PARM_DESC(pool_watermark, "pages kept pre-zeroed in each pool");
+
 static int order_to_index(unsigned int order)
 {
 	int i;
@@ -269,6 +281,10 @@ static int ion_system_heap_debug_show(struct ion_heap *heap, struct seq_file *s,
 		seq_printf(s, "%d order %u lowmem pages in pool = %lu total\n",
 			   pool->low_count, pool->order,
 			   (1 << pool->order) * PAGE_SIZE * pool->low_count);
+		seq_printf(s, "order %u pool: %lu hits %lu misses, "
+			   "watermark %d, %lu refilled %lu backoffs\n",
+			   pool->order, pool->hits, pool->misses,
+			   pool->watermark, pool->refills, pool->backoffs);
 	}
 	return 0;
 }
@@ -298,6 +314,10 @@ struct ion_heap *ion_system_heap_create(struct ion_platform_heap *unused)
 		if (!pool)
 			goto err_create_pool;
 		heap->pools[i] = pool;
+		/* the pool still works without its refill thread */
+		if (ion_page_pool_start_refill(pool, pool_watermark[i]))
+			pr_warn("%s: no refill thread for order %u pool\n",
+				__func__, orders[i]);
 	}
 	heap->heap.debug_show = ion_system_heap_debug_show;
 	return &heap->heap;
@@ -37,8 +37,18 @@ enum {
 enum {
 	FLAT_BINDER_FLAG_PRIORITY_MASK = 0xff,
 	FLAT_BINDER_FLAG_ACCEPTS_FDS = 0x100,
+	/*
+	 * Scheduling policy (SCHED_NORMAL, SCHED_FIFO, SCHED_RR or
+	 * SCHED_BATCH) of the floor priority in
+	 * FLAT_BINDER_FLAG_PRIORITY_MASK. The threads handling calls to
+	 * the object run at least at that priority, and at the priority
+	 * of the caller if it is higher.
+	 */
+	FLAT_BINDER_FLAG_SCHED_POLICY_MASK = 3U << 9,
 };
 
+#define FLAT_BINDER_FLAG_SCHED_POLICY_SHIFT	9
+
 /*
  * This is the flattened representation of a Binder object for transfer
  * between processes.  The 'offsets' supplied as part of a binder transaction
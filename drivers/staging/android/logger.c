@@ -25,6 +25,7 @@
 #include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/timer.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
@@ -33,37 +34,72 @@
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting.
+ *
+ * There is no lock. Offsets into the log are logical: they only ever grow,
+ * and logger_offset() turns them into an index into the buffer. Writers
+ * reserve space by advancing 'w_pos', and commit records in the order they
+ * reserved them by advancing 'w_off' past them. Everything before 'w_off' has
+ * been written. 'head' is the oldest record that has not been overwritten;
+ * writers move it forward before they overwrite anything.
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
-	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
-	size_t			head;	/* new readers start here */
+	atomic_long_t		w_pos;	/* next write is reserved here */
+	unsigned long		w_off;	/* current (committed) write head */
+	atomic_long_t		head;	/* new readers start here */
 	size_t			size;	/* size of the log */
+	unsigned long		wake_delay;	/* jiffies to batch wakeups */
+	size_t			wake_bytes;	/* ...or bytes, 0 for no limit */
+	atomic_t		wake_pending;	/* bytes since last wakeup */
+	unsigned long		wake_armed;	/* wake_timer is pending */
+	struct timer_list	wake_timer;	/* batched wakeup */
 };
 
+/* longest LOGGER_SET_WAKEUP lets readers be kept waiting */
+#define LOGGER_WAKEUP_MAX_DELAY_MS	1000
+
 /*
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. The structure is protected by 'mutex', which only
+ * serializes threads reading from the same file.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
-	struct list_head	list;	/* entry in logger_log's list */
-	size_t			r_off;	/* current read head offset */
+	struct mutex		mutex;	/* mutex protecting r_off and r_ver */
+	unsigned long		r_off;	/* current read head offset */
 	bool			r_all;	/* reader can read all entries */
 	int			r_ver;	/* reader ABI version */
 };
 
+/*
+ * struct logger_record - how an entry is stored in the ring buffer
+ *
+ * 'seq' is the logical offset the record was written at. A reader checks it,
+ * and that 'head' has not passed the record, after copying the record out;
+ * if either check fails, a writer lapped the reader and the copy is stale.
+ */
+struct logger_record {
+	unsigned long		seq;	/* logical offset of this record */
+	unsigned long		flags;	/* LOGGER_RECORD_* */
+	struct logger_entry	entry;	/* header as seen by userspace */
+};
+
+/* the payload faulted while being copied in, readers skip the record */
+#define LOGGER_RECORD_DISCARD	0x1UL
+
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 #define logger_offset(n)	((n) & (log->size - 1))
 
+static inline size_t record_len(struct logger_record *rec)
+{
+	return sizeof(struct logger_record) + rec->entry.len;
+}
+
 /*
  * file_get_log - Given a file structure, return the associated log
  *
@@ -88,39 +124,120 @@ static inline struct logger_log *file_get_log(struct file *file)
 }
 
 /*
- * get_entry_header - returns a pointer to the logger_entry header within
- * 'log' starting at offset 'off'. A temporary logger_entry 'scratch' must
- * be provided. Typically the return value will be a pointer within
- * 'logger->buf'.  However, a pointer to 'scratch' may be returned if
- * the log entry spans the end and beginning of the circular buffer.
+ * get_record_header - copies the logger_record header within 'log' starting
+ * at logical offset 'off' into 'rec'. The header may span the end and
+ * beginning of the circular buffer.
+ *
+ * Nothing stops a writer from overwriting the record meanwhile, so the caller
+ * must check record_valid() before trusting what was copied.
  */
-static struct logger_entry *get_entry_header(struct logger_log *log,
-		size_t off, struct logger_entry *scratch)
-{
-	size_t len = min(sizeof(struct logger_entry), log->size - off);
-	if (len != sizeof(struct logger_entry)) {
-		memcpy(((void *) scratch), log->buffer + off, len);
-		memcpy(((void *) scratch) + len, log->buffer,
-			sizeof(struct logger_entry) - len);
-		return scratch;
-	}
+static void get_record_header(struct logger_log *log, unsigned long off,
+			      struct logger_record *rec)
+{
+	size_t start = logger_offset(off);
+	size_t len = min(sizeof(struct logger_record), log->size - start);
 
-	return (struct logger_entry *) (log->buffer + off);
+	memcpy(rec, log->buffer + start, len);
+	if (len != sizeof(struct logger_record))
+		memcpy(((void *) rec) + len, log->buffer,
+			sizeof(struct logger_record) - len);
 }
 
 /*
- * get_entry_msg_len - Grabs the length of the message of the entry
- * starting from from 'off'.
+ * logger_lapped - has a writer started overwriting the record at 'off'?
  *
- * Caller needs to hold log->mutex.
+ * Pairs with the full barrier of the cmpxchg in fix_up_head(): a reader that
+ * saw any byte of an overwrite also sees the head that was moved past 'off'
+ * before it.
  */
-static __u32 get_entry_msg_len(struct logger_log *log, size_t off)
+static inline bool logger_lapped(struct logger_log *log, unsigned long off)
 {
-	struct logger_entry scratch;
-	struct logger_entry *entry;
+	smp_rmb();
+	return (long) (atomic_long_read(&log->head) - off) > 0;
+}
 
-	entry = get_entry_header(log, off, &scratch);
-	return entry->len;
+static inline bool record_valid(struct logger_log *log, unsigned long off,
+				struct logger_record *rec)
+{
+	return !logger_lapped(log, off) && rec->seq == off;
+}
+
+/*
+ * fix_up_reader - "fix up" a reader that was lapped by the writers, by
+ * pulling it forward to the first entry after the overwritten part of the
+ * log. Writers no longer walk the readers; each reader fixes itself up
+ * whenever it looks at the log.
+ *
+ * Caller needs to hold reader->mutex.
+ */
+static void fix_up_reader(struct logger_log *log, struct logger_reader *reader)
+{
+	unsigned long head = atomic_long_read(&log->head);
+
+	if ((long) (head - reader->r_off) > 0)
+		reader->r_off = head;
+}
+
+/*
+ * get_next_record - skips 'reader' past the records it may not read, then
+ * copies the header of the next one into 'rec'. Returns false if there is
+ * nothing left to read.
+ *
+ * Caller needs to hold reader->mutex.
+ */
+static bool get_next_record(struct logger_log *log,
+			    struct logger_reader *reader,
+			    struct logger_record *rec)
+{
+	uid_t euid = current_euid();
+
+	while (1) {
+		fix_up_reader(log, reader);
+		if (ACCESS_ONCE(log->w_off) == reader->r_off)
+			return false;
+
+		/* pairs with the smp_wmb() in logger_write_record() */
+		smp_rmb();
+		get_record_header(log, reader->r_off, rec);
+		if (!record_valid(log, reader->r_off, rec))
+			continue;
+
+		if (!(rec->flags & LOGGER_RECORD_DISCARD) &&
+		    (reader->r_all || rec->entry.euid == euid))
+			return true;
+
+		reader->r_off += record_len(rec);
+	}
+}
+
+/*
+ * logger_unread_len - bytes of entries, each a struct logger_entry and its
+ * payload, that 'reader' has yet to read. This is what LOGGER_GET_LOG_LEN has
+ * always reported, so the rest of each logger_record is left out.
+ *
+ * Caller needs to hold reader->mutex.
+ */
+static long logger_unread_len(struct logger_log *log,
+			      struct logger_reader *reader)
+{
+	struct logger_record rec;
+	unsigned long off, w_off;
+	long len;
+
+restart:
+	fix_up_reader(log, reader);
+	off = reader->r_off;
+	w_off = ACCESS_ONCE(log->w_off);
+	/* pairs with the smp_wmb() in logger_write_record() */
+	smp_rmb();
+	for (len = 0; off != w_off; off += record_len(&rec)) {
+		get_record_header(log, off, &rec);
+		if (!record_valid(log, off, &rec))
+			goto restart;
+		if (!(rec.flags & LOGGER_RECORD_DISCARD))
+			len += sizeof(struct logger_entry) + rec.entry.len;
+	}
+	return len;
 }
 
 static size_t get_user_hdr_len(int ver)
@@ -156,18 +273,18 @@ static ssize_t copy_header_to_user(int ver, struct logger_entry *entry,
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * do_read_log_to_user - reads exactly 'count' bytes of the record 'rec' at
+ * the reader's offset into the user-space buffer 'buf'. Returns 'count' on
+ * success, or -EAGAIN if the record was overwritten while being copied.
  *
- * Caller must hold log->mutex.
+ * Caller must hold reader->mutex.
  */
 static ssize_t do_read_log_to_user(struct logger_log *log,
 				   struct logger_reader *reader,
+				   struct logger_record *rec,
 				   char __user *buf,
 				   size_t count)
 {
-	struct logger_entry scratch;
-	struct logger_entry *entry;
 	size_t len;
 	size_t msg_start;
 
@@ -175,13 +292,12 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * First, copy the header to userspace, using the version of
 	 * the header requested
 	 */
-	entry = get_entry_header(log, reader->r_off, &scratch);
-	if (copy_header_to_user(reader->r_ver, entry, buf))
+	if (copy_header_to_user(reader->r_ver, &rec->entry, buf))
 		return -EFAULT;
 
 	count -= get_user_hdr_len(reader->r_ver);
 	buf += get_user_hdr_len(reader->r_ver);
-	msg_start = logger_offset(reader->r_off + sizeof(struct logger_entry));
+	msg_start = logger_offset(reader->r_off + sizeof(struct logger_record));
 
 	/*
 	 * We read from the msg in two disjoint operations. First, we read from
@@ -200,53 +316,31 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 		if (copy_to_user(buf + len, log->buffer, count - len))
 			return -EFAULT;
 
-	reader->r_off = logger_offset(reader->r_off +
-		sizeof(struct logger_entry) + count);
-
-	return count + get_user_hdr_len(reader->r_ver);
-}
-
-/*
- * get_next_entry_by_uid - Starting at 'off', returns an offset into
- * 'log->buffer' which contains the first entry readable by 'euid'
- */
-static size_t get_next_entry_by_uid(struct logger_log *log,
-		size_t off, uid_t euid)
-{
-	while (off != log->w_off) {
-		struct logger_entry *entry;
-		struct logger_entry scratch;
-		size_t next_len;
-
-		entry = get_entry_header(log, off, &scratch);
+	if (logger_lapped(log, reader->r_off))
+		return -EAGAIN;
 
-		if (entry->euid == euid)
-			return off;
+	reader->r_off += record_len(rec);
 
-		next_len = sizeof(struct logger_entry) + entry->len;
-		off = logger_offset(off + next_len);
-	}
-
-	return off;
+	return count + get_user_hdr_len(reader->r_ver);
 }
 
 /*
- * logger_read - our log's read() method
+ * logger_read_entries - reads log entries into 'buf', 'count' bytes long
  *
- * Behavior:
+ * Blocks until there is something to read, unless O_NONBLOCK is set. Reads
+ * one entry, or as many whole entries as fit if 'bulk' is set, and returns
+ * the number of bytes read. The number of entries is stored in 'entries'.
  *
- * 	- O_NONBLOCK works
- * 	- If there are no log entries to read, blocks until log is written to
- * 	- Atomically reads exactly one log entry
- *
- * Will set errno to EINVAL if read
- * buffer is insufficient to hold next entry.
+ * Returns -EINVAL if 'buf' is too small to hold the next entry.
  */
-static ssize_t logger_read(struct file *file, char __user *buf,
-			   size_t count, loff_t *pos)
+static ssize_t logger_read_entries(struct file *file, char __user *buf,
+				   size_t count, bool bulk,
+				   unsigned int *entries)
 {
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
+	struct logger_record rec;
+	size_t done;
 	ssize_t ret;
 	DEFINE_WAIT(wait);
 
@@ -254,9 +348,10 @@ start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		mutex_lock(&reader->mutex);
+		fix_up_reader(log, reader);
+		ret = (ACCESS_ONCE(log->w_off) == reader->r_off);
+		mutex_unlock(&reader->mutex);
 		if (!ret)
 			break;
 
@@ -277,139 +372,285 @@ start:
 	if (ret)
 		return ret;
 
-	mutex_lock(&log->mutex);
+	mutex_lock(&reader->mutex);
 
-	if (!reader->r_all)
-		reader->r_off = get_next_entry_by_uid(log,
-			reader->r_off, current_euid());
+	done = 0;
+	*entries = 0;
+	while (get_next_record(log, reader, &rec)) {
+		/* get the size of the next entry */
+		ret = get_user_hdr_len(reader->r_ver) + rec.entry.len;
+		if (count - done < ret) {
+			if (!done)
+				ret = -EINVAL;
+			break;
+		}
 
-	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
-		goto start;
-	}
+		/* get exactly one entry from the log */
+		ret = do_read_log_to_user(log, reader, &rec, buf + done, ret);
+		if (ret == -EAGAIN) {
+			/* lapped while copying, get_next_record() fixes us up */
+			ret = 0;
+			continue;
+		}
+		if (ret < 0)
+			break;
 
-	/* get the size of the next entry */
-	ret = get_user_hdr_len(reader->r_ver) +
-		get_entry_msg_len(log, reader->r_off);
-	if (count < ret) {
-		ret = -EINVAL;
-		goto out;
+		done += ret;
+		(*entries)++;
+		if (!bulk)
+			break;
 	}
 
-	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	mutex_unlock(&reader->mutex);
 
-out:
-	mutex_unlock(&log->mutex);
+	if (done)
+		return done;
+
+	/* did we race with the writers lapping us? */
+	if (!ret)
+		goto start;
 
 	return ret;
 }
 
 /*
- * get_next_entry - return the offset of the first valid entry at least 'len'
- * bytes after 'off'.
+ * logger_read - our log's read() method
  *
- * Caller must hold log->mutex.
- */
-static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
-{
-	size_t count = 0;
-
-	do {
-		size_t nr = sizeof(struct logger_entry) +
-			get_entry_msg_len(log, off);
-		off = logger_offset(off + nr);
-		count += nr;
-	} while (count < len);
-
-	return off;
-}
-
-/*
- * clock_interval - is a < c < b in mod-space? Put another way, does the line
- * from a to b cross c?
+ * Behavior:
+ *
+ * 	- O_NONBLOCK works
+ * 	- If there are no log entries to read, blocks until log is written to
+ * 	- Atomically reads exactly one log entry
+ *
+ * Will set errno to EINVAL if read
+ * buffer is insufficient to hold next entry.
  */
-static inline int clock_interval(size_t a, size_t b, size_t c)
+static ssize_t logger_read(struct file *file, char __user *buf,
+			   size_t count, loff_t *pos)
 {
-	if (b < a) {
-		if (a < c || b >= c)
-			return 1;
-	} else {
-		if (a < c && b >= c)
-			return 1;
-	}
+	unsigned int entries;
 
-	return 0;
+	return logger_read_entries(file, buf, count, false, &entries);
 }
 
 /*
- * fix_up_readers - walk the list of all readers and "fix up" any who were
- * lapped by the writer; also do the same for the default "start head".
- * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
+ * fix_up_head - moves the start head past every record that a write ending
+ * at logical offset 'end' is about to overwrite. Readers still behind it are
+ * pulled forward by fix_up_reader().
  *
- * The caller needs to hold log->mutex.
+ * Runs with preemption disabled. Waiting for an uncommitted record to be
+ * committed is therefore only ever waiting for a writer on another CPU.
  */
-static void fix_up_readers(struct logger_log *log, size_t len)
+static void fix_up_head(struct logger_log *log, unsigned long end)
 {
-	size_t old = log->w_off;
-	size_t new = logger_offset(old + len);
-	struct logger_reader *reader;
+	unsigned long head = atomic_long_read(&log->head);
+
+	while ((long) (end - head) > (long) log->size) {
+		struct logger_record rec;
+		unsigned long next, old;
 
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+		/* the record at head has not been committed yet */
+		if ((long) (ACCESS_ONCE(log->w_off) - head) <= 0) {
+			cpu_relax();
+			head = atomic_long_read(&log->head);
+			continue;
+		}
 
-	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
+		/*
+		 * If another writer moves the head and overwrites the record
+		 * while we look at it, the cmpxchg fails and 'rec' is unused.
+		 */
+		smp_rmb();
+		get_record_header(log, head, &rec);
+		next = head + record_len(&rec);
+		old = atomic_long_cmpxchg(&log->head, head, next);
+		head = (old == head) ? next : old;
+	}
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
- *
- * The caller needs to hold log->mutex.
+ * do_write_log - writes 'count' bytes from 'buf' to 'log' at logical
+ * offset 'off'
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static void do_write_log(struct logger_log *log, unsigned long off,
+			 const void *buf, size_t count)
 {
+	size_t start = logger_offset(off);
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	len = min(count, log->size - start);
+	memcpy(log->buffer + start, buf, len);
 
 	if (count != len)
 		memcpy(log->buffer, buf + len, count - len);
-
-	log->w_off = logger_offset(log->w_off + count);
-
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
+ * do_write_log_from_user - writes 'count' bytes from the user-space buffer
+ * 'buf' to the log 'log' at logical offset 'off'
  *
- * The caller needs to hold log->mutex.
+ * Page faults are disabled by the caller, so this fails rather than sleeps
+ * if the user buffer is not resident.
  *
  * Returns 'count' on success, negative error code on failure.
  */
 static ssize_t do_write_log_from_user(struct logger_log *log,
+				      unsigned long off,
 				      const void __user *buf, size_t count)
 {
+	size_t start = logger_offset(off);
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
+	if (!access_ok(VERIFY_READ, buf, count))
+		return -EFAULT;
+
+	len = min(count, log->size - start);
+	if (len && __copy_from_user_inatomic(log->buffer + start, buf, len))
 		return -EFAULT;
 
 	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
+		if (__copy_from_user_inatomic(log->buffer, buf + len,
+					      count - len))
 			return -EFAULT;
 
-	log->w_off = logger_offset(log->w_off + count);
-
 	return count;
 }
 
+/*
+ * logger_write_record - reserves room in 'log' for the entry 'header' and
+ * its payload, copies them in and commits the record. The payload is taken
+ * from 'kbuf' if it is set, else from the user iovec.
+ *
+ * Writers take no lock. Preemption is disabled from reservation to commit, so
+ * that a writer only ever waits, in fix_up_head() or for its turn to commit,
+ * for writers that are running on other CPUs.
+ *
+ * Returns 0, or -EFAULT if the user payload could not be copied without
+ * faulting; the record is then committed but skipped by readers.
+ */
+static int logger_write_record(struct logger_log *log,
+			       struct logger_entry *header,
+			       const struct iovec *iov, unsigned long nr_segs,
+			       const void *kbuf)
+{
+	struct logger_record rec;
+	unsigned long off;
+	size_t done = 0;
+	int ret = 0;
+
+	rec.entry = *header;
+	rec.flags = 0;
+
+	preempt_disable();
+	pagefault_disable();
+
+	off = atomic_long_add_return(record_len(&rec), &log->w_pos) -
+		record_len(&rec);
+	rec.seq = off;
+
+	fix_up_head(log, off + record_len(&rec));
+
+	do_write_log(log, off, &rec, sizeof(struct logger_record));
+
+	if (kbuf) {
+		do_write_log(log, off + sizeof(struct logger_record), kbuf,
+			     header->len);
+	} else {
+		while (nr_segs-- > 0 && done < header->len) {
+			size_t len;
+			ssize_t nr;
+
+			/* figure out how much of this vector we can keep */
+			len = min_t(size_t, iov->iov_len, header->len - done);
+
+			/* write out this segment's payload */
+			nr = do_write_log_from_user(log,
+				off + sizeof(struct logger_record) + done,
+				iov->iov_base, len);
+			if (unlikely(nr < 0)) {
+				rec.flags |= LOGGER_RECORD_DISCARD;
+				do_write_log(log, off, &rec,
+					     sizeof(struct logger_record));
+				ret = nr;
+				break;
+			}
+
+			iov++;
+			done += nr;
+		}
+	}
+
+	/* commit in reservation order */
+	while (ACCESS_ONCE(log->w_off) != off)
+		cpu_relax();
+	smp_wmb();
+	ACCESS_ONCE(log->w_off) = off + record_len(&rec);
+
+	pagefault_enable();
+	preempt_enable();
+
+	return ret;
+}
+
+/*
+ * logger_wake_timer - the end of a batching delay, wake up the readers
+ */
+static void logger_wake_timer(unsigned long data)
+{
+	struct logger_log *log = (struct logger_log *) data;
+
+	clear_bit(0, &log->wake_armed);
+	atomic_set(&log->wake_pending, 0);
+	wake_up_interruptible(&log->wq);
+}
+
+/*
+ * logger_wake_readers - wake up any blocked readers after 'len' bytes were
+ * written, or, if the log batches wakeups, once its delay or byte limit
+ * is reached
+ */
+static void logger_wake_readers(struct logger_log *log, size_t len)
+{
+	unsigned long delay = ACCESS_ONCE(log->wake_delay);
+	size_t bytes = ACCESS_ONCE(log->wake_bytes);
+
+	if (!delay) {
+		wake_up_interruptible(&log->wq);
+		return;
+	}
+
+	if (bytes &&
+	    (size_t) atomic_add_return(len, &log->wake_pending) >= bytes) {
+		atomic_set(&log->wake_pending, 0);
+		wake_up_interruptible(&log->wq);
+		return;
+	}
+
+	if (!test_and_set_bit(0, &log->wake_armed))
+		mod_timer(&log->wake_timer, jiffies + delay);
+}
+
+/*
+ * copy_iov_from_user - copies the first 'count' bytes described by 'iov'
+ * into the kernel buffer 'buf', faulting the user pages in as needed.
+ */
+static int copy_iov_from_user(void *buf, const struct iovec *iov,
+			      unsigned long nr_segs, size_t count)
+{
+	size_t done = 0;
+
+	while (nr_segs-- > 0 && done < count) {
+		size_t len = min_t(size_t, iov->iov_len, count - done);
+
+		if (copy_from_user(buf + done, iov->iov_base, len))
+			return -EFAULT;
+		iov++;
+		done += len;
+	}
+
+	return 0;
+}
+
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
@@ -419,10 +660,10 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
 	struct logger_entry header;
 	struct timespec now;
-	ssize_t ret = 0;
+	void *kbuf;
+	int ret;
 
 	now = current_kernel_time();
 
@@ -438,43 +679,26 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
-
-	do_write_log(log, &header, sizeof(struct logger_entry));
-
-	while (nr_segs-- > 0) {
-		size_t len;
-		ssize_t nr;
-
-		/* figure out how much of this vector we can keep */
-		len = min_t(size_t, iov->iov_len, header.len - ret);
-
-		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
-		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
-		}
-
-		iov++;
-		ret += nr;
+	ret = logger_write_record(log, &header, iov, nr_segs, NULL);
+	if (unlikely(ret)) {
+		/*
+		 * The payload is not resident. Fault it in through a bounce
+		 * buffer, where sleeping is allowed, and write it again.
+		 */
+		kbuf = kmalloc(header.len, GFP_KERNEL);
+		if (!kbuf)
+			return -ENOMEM;
+		ret = copy_iov_from_user(kbuf, iov, nr_segs, header.len);
+		if (!ret)
+			logger_write_record(log, &header, NULL, 0, kbuf);
+		kfree(kbuf);
+		if (ret)
+			return ret;
 	}
 
-	mutex_unlock(&log->mutex);
-
-	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	logger_wake_readers(log, sizeof(struct logger_record) + header.len);
 
-	return ret;
+	return header.len;
 }
 
 static struct logger_log *get_log_from_minor(int);
@@ -509,12 +733,8 @@ static int logger_open(struct inode *inode, struct file *file)
 		reader->r_all = in_egroup_p(inode->i_gid) ||
 			capable(CAP_SYSLOG);
 
-		INIT_LIST_HEAD(&reader->list);
-
-		mutex_lock(&log->mutex);
-		reader->r_off = log->head;
-		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		mutex_init(&reader->mutex);
+		reader->r_off = atomic_long_read(&log->head);
 
 		file->private_data = reader;
 	} else
@@ -532,11 +752,6 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
-		struct logger_log *log = reader->log;
-
-		mutex_lock(&log->mutex);
-		list_del(&reader->list);
-		mutex_unlock(&log->mutex);
 
 		kfree(reader);
 	}
@@ -557,6 +772,7 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 {
 	struct logger_reader *reader;
 	struct logger_log *log;
+	struct logger_record rec;
 	unsigned int ret = POLLOUT | POLLWRNORM;
 
 	if (!(file->f_mode & FMODE_READ))
@@ -567,14 +783,10 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
-	if (!reader->r_all)
-		reader->r_off = get_next_entry_by_uid(log,
-			reader->r_off, current_euid());
-
-	if (log->w_off != reader->r_off)
+	mutex_lock(&reader->mutex);
+	if (get_next_record(log, reader, &rec))
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
+	mutex_unlock(&reader->mutex);
 
 	return ret;
 }
@@ -592,44 +804,102 @@ static long logger_set_version(struct logger_reader *reader, void __user *arg)
 	return 0;
 }
 
+/*
+ * logger_flush - moves the start head up to the write head, which pulls
+ * every reader forward to it as well
+ */
+static void logger_flush(struct logger_log *log)
+{
+	unsigned long head = atomic_long_read(&log->head);
+	unsigned long w_off = ACCESS_ONCE(log->w_off);
+	unsigned long old;
+
+	while ((long) (w_off - head) > 0) {
+		old = atomic_long_cmpxchg(&log->head, head, w_off);
+		if (old == head)
+			break;
+		head = old;
+	}
+}
+
+static long logger_read_bulk(struct file *file, void __user *arg)
+{
+	struct logger_bulk_read req;
+	ssize_t ret;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+
+	ret = logger_read_entries(file, (char __user *) (unsigned long) req.buf,
+				  req.len, true, &req.entries);
+	if (ret < 0)
+		return ret;
+
+	if (put_user(req.entries, &((struct logger_bulk_read __user *)
+				    arg)->entries))
+		return -EFAULT;
+
+	return ret;
+}
+
+static long logger_set_wakeup(struct logger_log *log,
+			      struct logger_reader *reader, void __user *arg)
+{
+	struct logger_wakeup req;
+
+	if (!reader->r_all)
+		return -EPERM;
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+
+	if (req.delay_ms > LOGGER_WAKEUP_MAX_DELAY_MS)
+		return -EINVAL;
+
+	log->wake_bytes = req.bytes;
+	log->wake_delay = msecs_to_jiffies(req.delay_ms);
+	return 0;
+}
+
 static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
-	struct logger_reader *reader;
+	struct logger_reader *reader = NULL;
+	struct logger_record rec;
 	long ret = -EINVAL;
 	void __user *argp = (void __user *) arg;
 
-	mutex_lock(&log->mutex);
+	/* this one blocks, and takes reader->mutex itself */
+	if (cmd == LOGGER_READ_BULK)
+		return logger_read_bulk(file, argp);
+
+	if (file->f_mode & FMODE_READ) {
+		reader = file->private_data;
+		mutex_lock(&reader->mutex);
+	}
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
 		ret = log->size;
 		break;
 	case LOGGER_GET_LOG_LEN:
-		if (!(file->f_mode & FMODE_READ)) {
+		if (!reader) {
 			ret = -EBADF;
 			break;
 		}
-		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
-		else
-			ret = (log->size - reader->r_off) + log->w_off;
+		ret = logger_unread_len(log, reader);
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
-		if (!(file->f_mode & FMODE_READ)) {
+		if (!reader) {
 			ret = -EBADF;
 			break;
 		}
-		reader = file->private_data;
 
-		if (!reader->r_all)
-			reader->r_off = get_next_entry_by_uid(log,
-				reader->r_off, current_euid());
-
-		if (log->w_off != reader->r_off)
-			ret = get_user_hdr_len(reader->r_ver) +
-				get_entry_msg_len(log, reader->r_off);
+		if (get_next_record(log, reader, &rec))
+			ret = get_user_hdr_len(reader->r_ver) + rec.entry.len;
 		else
 			ret = 0;
 		break;
@@ -638,30 +908,34 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			ret = -EBADF;
 			break;
 		}
-		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
+		logger_flush(log);
 		ret = 0;
 		break;
 	case LOGGER_GET_VERSION:
-		if (!(file->f_mode & FMODE_READ)) {
+		if (!reader) {
 			ret = -EBADF;
 			break;
 		}
-		reader = file->private_data;
 		ret = reader->r_ver;
 		break;
 	case LOGGER_SET_VERSION:
-		if (!(file->f_mode & FMODE_READ)) {
+		if (!reader) {
 			ret = -EBADF;
 			break;
 		}
-		reader = file->private_data;
 		ret = logger_set_version(reader, argp);
 		break;
+	case LOGGER_SET_WAKEUP:
+		if (!reader) {
+			ret = -EBADF;
+			break;
+		}
+		ret = logger_set_wakeup(log, reader, argp);
+		break;
 	}
 
-	mutex_unlock(&log->mutex);
+	if (reader)
+		mutex_unlock(&reader->mutex);
 
 	return ret;
 }
@@ -680,7 +954,7 @@ static const struct file_operations logger_fops = {
 /*
  * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
  * must be a power of two, and greater than
- * (LOGGER_ENTRY_MAX_PAYLOAD + sizeof(struct logger_entry)).
+ * (LOGGER_ENTRY_MAX_PAYLOAD + sizeof(struct logger_record)).
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
 static unsigned char _buf_ ## VAR[SIZE]; \
@@ -693,11 +967,13 @@ static struct logger_log VAR = { \
 		.parent = NULL, \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
-	.readers = LIST_HEAD_INIT(VAR .readers), \
-	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
+	.w_pos = ATOMIC_LONG_INIT(0), \
 	.w_off = 0, \
-	.head = 0, \
+	.head = ATOMIC_LONG_INIT(0), \
 	.size = SIZE, \
+	.wake_pending = ATOMIC_INIT(0), \
+	.wake_timer = TIMER_INITIALIZER(logger_wake_timer, 0, \
+				       (unsigned long) &VAR), \
 };
 
 DEFINE_LOGGER_DEVICE(log_main, LOGGER_LOG_MAIN, 256*1024)
@@ -51,6 +51,27 @@ struct logger_entry {
 	char		msg[0];		/* the entry's payload */
 };
 
+/*
+ * Argument of LOGGER_READ_BULK. As many whole entries as fit in 'len' bytes
+ * are copied to 'buf', each one a header of the reader's ABI version
+ * followed by its payload. The ioctl returns the number of bytes copied.
+ */
+struct logger_bulk_read {
+	__u64		buf;		/* user buffer */
+	__u32		len;		/* size of the user buffer */
+	__u32		entries;	/* returns the number of entries read */
+};
+
+/*
+ * Argument of LOGGER_SET_WAKEUP. Once set, readers of the log are woken at
+ * most every 'delay_ms' milliseconds, or as soon as 'bytes' bytes have been
+ * written since the last wakeup. A 'delay_ms' of 0 wakes them on each write.
+ */
+struct logger_wakeup {
+	__u32		delay_ms;	/* longest a wakeup is held back */
+	__u32		bytes;		/* wake early after this much, 0 to not */
+};
+
 #define LOGGER_LOG_RADIO	"log_radio"	/* radio-related messages */
 #define LOGGER_LOG_EVENTS	"log_events"	/* system/hardware events */
 #define LOGGER_LOG_SYSTEM	"log_system"	/* system/framework messages */
@@ -66,5 +87,8 @@ struct logger_entry {
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
 #define LOGGER_GET_VERSION		_IO(__LOGGERIO, 5) /* abi version */
 #define LOGGER_SET_VERSION		_IO(__LOGGERIO, 6) /* abi version */
+#define LOGGER_READ_BULK		_IOWR(__LOGGERIO, 7, \
+					      struct logger_bulk_read)
+#define LOGGER_SET_WAKEUP		_IOW(__LOGGERIO, 8, struct logger_wakeup)
 
 #endif /* _LINUX_LOGGER_H */
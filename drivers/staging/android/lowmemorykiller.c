@@ -16,6 +16,19 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * Processes are kept in one bucket per oom_adj value, so picking victims
+ * only looks at the buckets that may be killed from, highest oom_adj first.
+ * Selection latency and kill counts are in
+ * /sys/kernel/debug/lowmemorykiller/stats.
+ *
+ * Free memory can stay above every minfree level while the system thrashes,
+ * reclaiming almost nothing of what it scans.  With vmpressure_kill set,
+ * the driver also watches reclaim efficiency (see mm/vmpressure.c): after
+ * vmpressure_windows consecutive windows at or above vmpressure_high
+ * percent, the highest adj level is killed even though minfree was not
+ * reached.  Pressure must fall below vmpressure_low before that state
+ * ends, and a fresh run of high windows is needed after each such kill.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -36,6 +49,11 @@
 #include <linux/sched.h>
 #include <linux/rcupdate.h>
 #include <linux/notifier.h>
+#include <linux/spinlock.h>
+#include <linux/hrtimer.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/vmpressure.h>
 #ifdef CONFIG_ZRAM_FOR_ANDROID
 #include <linux/swap.h>
 #include <linux/device.h>
@@ -46,6 +64,8 @@
 
 #ifdef ENHANCED_LMK_ROUTINE
 #define LOWMEM_DEATHPENDING_DEPTH 3
+#else
+#define LOWMEM_DEATHPENDING_DEPTH 1
 #endif
 
 static uint32_t lowmem_debug_level = 1;
@@ -63,6 +83,20 @@ static int lowmem_minfree[6] = {
 	16 * 1024,	/* 64MB */
 };
 static int lowmem_minfree_size = 4;
+
+static int lowmem_vmpressure_kill;
+static int lowmem_vmpressure_high = 95;
+static int lowmem_vmpressure_low = 60;
+static int lowmem_vmpressure_windows = 2;
+/*
+ * Updated by lowmem_vmpressure_notify() and re-armed by lowmem_shrink(),
+ * both under lowmem_vmpressure_lock.  Readers that only peek at them,
+ * lowmem_shrink() and the stats file, do without it.
+ */
+static DEFINE_SPINLOCK(lowmem_vmpressure_lock);
+static unsigned long lowmem_vmpressure_last;
+static int lowmem_vmpressure_run;
+static bool lowmem_under_pressure;
 #ifdef CONFIG_ZRAM_FOR_ANDROID
 static struct class *lmk_class;
 static struct device *lmk_dev;
@@ -93,14 +127,41 @@ enum pageout_io {
 
 #endif /* CONFIG_ZRAM_FOR_ANDROID */
 
-#ifdef ENHANCED_LMK_ROUTINE
 static struct task_struct *lowmem_deathpending[LOWMEM_DEATHPENDING_DEPTH] = {NULL,};
-#else
-static struct task_struct *lowmem_deathpending;
-#endif
 
 static unsigned long lowmem_deathpending_timeout;
 
+/*
+ * Only thread group leaders are indexed.  A leader is filed on fork,
+ * re-filed whenever its oom_adj is written and unlinked by
+ * task_notify_func() just before it is freed, so a task found on a bucket
+ * can be dereferenced under lowmem_bucket_lock.  Its signal_struct cannot:
+ * that is released before the task is, so the bucket is what gives the
+ * oom_adj of an indexed task.
+ */
+#define LOWMEM_ADJ_BUCKETS	(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+#define lowmem_bucket(adj)	(&lowmem_buckets[(adj) - OOM_DISABLE])
+/* tasks pinned and sized per batch while walking a bucket, bounds the stack */
+#define LOWMEM_SCAN_BATCH	32
+
+static struct list_head lowmem_buckets[LOWMEM_ADJ_BUCKETS];
+/* stamped into lmk_seq on every re-file, so a scan can tell it moved */
+static unsigned int lowmem_bucket_seq;
+static bool lowmem_index_ready;
+/* task_notify_func() can run from an RCU callback, so irqsave */
+static DEFINE_SPINLOCK(lowmem_bucket_lock);
+
+/* protected by lowmem_bucket_lock */
+static struct {
+	u64 selections;
+	u64 select_ns_total;
+	u64 select_ns_max;
+	u64 select_ns_last;
+	u64 kills;
+	u64 pressure_kills;
+	u64 adj_kills[LOWMEM_ADJ_BUCKETS];
+} lowmem_stats;
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
@@ -118,46 +179,103 @@ static int
 task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 {
 	struct task_struct *task = data;
-
-#ifdef ENHANCED_LMK_ROUTINE
+	unsigned long flags;
 	int i = 0;
+
+	spin_lock_irqsave(&lowmem_bucket_lock, flags);
+	list_del_init(&task->lmk_node);
+	spin_unlock_irqrestore(&lowmem_bucket_lock, flags);
+
 	for (i = 0; i < LOWMEM_DEATHPENDING_DEPTH; i++)
 		if (task == lowmem_deathpending[i]) {
 			lowmem_deathpending[i] = NULL;
 		break;
 	}
-#else
-	if (task == lowmem_deathpending)
-		lowmem_deathpending = NULL;
-#endif
 	return NOTIFY_OK;
 }
 
+/*
+ * Called on fork, exec and oom_adj writes with a reference on tsk held and
+ * no task or sighand locks, which keeps lowmem_bucket_lock innermost.
+ */
+void lowmem_task_update(struct task_struct *tsk)
+{
+	struct task_struct *leader;
+	unsigned long flags;
+	int adj;
+
+	rcu_read_lock();
+	if (!pid_alive(tsk))
+		goto out;
+	leader = tsk->group_leader;
+	adj = clamp_t(int, tsk->signal->oom_adj, OOM_DISABLE, OOM_ADJUST_MAX);
+
+	spin_lock_irqsave(&lowmem_bucket_lock, flags);
+	/* a leader already on its way to task_notify_func() stays out */
+	if (lowmem_index_ready && atomic_read(&leader->usage) &&
+	    !(leader->flags & PF_KTHREAD)) {
+		list_move_tail(&leader->lmk_node, lowmem_bucket(adj));
+		leader->lmk_seq = ++lowmem_bucket_seq;
+	}
+	spin_unlock_irqrestore(&lowmem_bucket_lock, flags);
+out:
+	rcu_read_unlock();
+}
+
+static int lowmem_vmpressure_notify(struct notifier_block *nb,
+				    unsigned long pressure, void *data)
+{
+	spin_lock(&lowmem_vmpressure_lock);
+	lowmem_vmpressure_last = pressure;
+	if (!lowmem_vmpressure_kill) {
+		lowmem_vmpressure_run = 0;
+		lowmem_under_pressure = false;
+		spin_unlock(&lowmem_vmpressure_lock);
+		return NOTIFY_DONE;
+	}
+
+	if (pressure >= lowmem_vmpressure_high) {
+		if (++lowmem_vmpressure_run >= lowmem_vmpressure_windows &&
+		    !lowmem_under_pressure) {
+			lowmem_under_pressure = true;
+			lowmem_print(2, "vmpressure %lu, reclaim is failing\n",
+				     pressure);
+		}
+	} else {
+		lowmem_vmpressure_run = 0;
+		if (pressure < lowmem_vmpressure_low && lowmem_under_pressure) {
+			lowmem_under_pressure = false;
+			lowmem_print(2, "vmpressure %lu, recovered\n",
+				     pressure);
+		}
+	}
+	spin_unlock(&lowmem_vmpressure_lock);
+	return NOTIFY_OK;
+}
+
+static struct notifier_block lowmem_vmpressure_nb = {
+	.notifier_call = lowmem_vmpressure_notify,
+};
+
 static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 {
 	struct task_struct *tsk;
-#ifdef ENHANCED_LMK_ROUTINE
 	struct task_struct *selected[LOWMEM_DEATHPENDING_DEPTH] = {NULL,};
-#else
-	struct task_struct *selected = NULL;
-#endif
+	int selected_tasksize[LOWMEM_DEATHPENDING_DEPTH] = {0,};
+	int selected_oom_adj[LOWMEM_DEATHPENDING_DEPTH] = {0,};
+	int nr_selected = 0;
+	bool pressure_kill = false;
 	int rem = 0;
 	int tasksize;
-	int i;
+	int i, adj;
 	int min_adj = OOM_ADJUST_MAX + 1;
-#ifdef ENHANCED_LMK_ROUTINE
-	int selected_tasksize[LOWMEM_DEATHPENDING_DEPTH] = {0,};
-	int selected_oom_adj[LOWMEM_DEATHPENDING_DEPTH] = {OOM_ADJUST_MAX,};
-	int all_selected_oom = 0;
-	int max_selected_oom_idx = 0;
-#else
-	int selected_tasksize = 0;
-	int selected_oom_adj;
-#endif
 	int array_size = ARRAY_SIZE(lowmem_adj);
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES) -
 						global_page_state(NR_SHMEM);
+	unsigned long flags;
+	ktime_t start;
+	u64 delta;
 
 	/*
 	 * If we already have a death outstanding, then
@@ -166,17 +284,11 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 	 * this pass.
 	 *
 	 */
-#ifdef ENHANCED_LMK_ROUTINE
 	for (i = 0; i < LOWMEM_DEATHPENDING_DEPTH; i++) {
 		if (lowmem_deathpending[i] &&
 			time_before_eq(jiffies, lowmem_deathpending_timeout))
 			return 0;
 	}
-#else
-	if (lowmem_deathpending &&
-	    time_before_eq(jiffies, lowmem_deathpending_timeout))
-		return 0;
-#endif
 
 	if (lowmem_adj_size < array_size)
 		array_size = lowmem_adj_size;
@@ -189,10 +301,16 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 			break;
 		}
 	}
+	if (min_adj == OOM_ADJUST_MAX + 1 && lowmem_under_pressure &&
+	    array_size > 0) {
+		/* minfree not reached, but reclaim is getting nowhere */
+		min_adj = lowmem_adj[array_size - 1];
+		pressure_kill = true;
+	}
 	if (sc->nr_to_scan > 0)
-		lowmem_print(3, "lowmem_shrink %lu, %x, ofree %d %d, ma %d\n",
+		lowmem_print(3, "lowmem_shrink %lu, %x, ofree %d %d, ma %d%s\n",
 			     sc->nr_to_scan, sc->gfp_mask, other_free, other_file,
-			     min_adj);
+			     min_adj, pressure_kill ? " (vmpressure)" : "");
 	rem = global_page_state(NR_ACTIVE_ANON) +
 		global_page_state(NR_ACTIVE_FILE) +
 		global_page_state(NR_INACTIVE_ANON) +
@@ -202,114 +320,151 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 			     sc->nr_to_scan, sc->gfp_mask, rem);
 		return rem;
 	}
-#ifdef ENHANCED_LMK_ROUTINE
-	for (i = 0; i < LOWMEM_DEATHPENDING_DEPTH; i++)
-		selected_oom_adj[i] = min_adj;
-#else
-	selected_oom_adj = min_adj;
-#endif
-
-	rcu_read_lock();
-	for_each_process(tsk) {
-		struct task_struct *p;
-		int oom_adj;
-#ifdef ENHANCED_LMK_ROUTINE
-		int is_exist_oom_task = 0;
-#endif
-
-		if (tsk->flags & PF_KTHREAD)
-			continue;
-
-		p = find_lock_task_mm(tsk);
-		if (!p)
-			continue;
+	if (min_adj < OOM_DISABLE)
+		min_adj = OOM_DISABLE;
 
-		oom_adj = p->signal->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(p->mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-#ifdef ENHANCED_LMK_ROUTINE
-		if (all_selected_oom < LOWMEM_DEATHPENDING_DEPTH) {
-			for (i = 0; i < LOWMEM_DEATHPENDING_DEPTH; i++) {
-				if (!selected[i]) {
-					is_exist_oom_task = 1;
-					max_selected_oom_idx = i;
+	start = ktime_get();
+	/*
+	 * Fill the victim slots from the highest oom_adj bucket down. Within
+	 * a bucket, the largest tasks win the slots that bucket gets.
+	 */
+	for (adj = OOM_ADJUST_MAX;
+	     adj >= min_adj && nr_selected < LOWMEM_DEATHPENDING_DEPTH; adj--) {
+		struct list_head *bucket = lowmem_bucket(adj);
+		struct task_struct *cursor = NULL;
+		unsigned int cursor_seq = 0;
+		int first = nr_selected;
+		bool done = false;
+
+		while (!done) {
+			struct task_struct *batch[LOWMEM_SCAN_BATCH];
+			struct task_struct *last = cursor;
+			struct list_head *pos;
+			int nr_batch = 0;
+			int b;
+
+			/*
+			 * Only pin the candidates under lowmem_bucket_lock, it
+			 * has to stay innermost: find_lock_task_mm() takes
+			 * task_lock.  Resume after the last task pinned, or
+			 * from the head if that one was re-filed meanwhile.
+			 */
+			spin_lock_irqsave(&lowmem_bucket_lock, flags);
+			if (cursor && cursor->lmk_seq == cursor_seq)
+				pos = &cursor->lmk_node;
+			else
+				pos = bucket;
+			cursor = NULL;
+			for (pos = pos->next; pos != bucket; pos = pos->next) {
+				if (nr_batch == LOWMEM_SCAN_BATCH)
 					break;
-				}
+				tsk = list_entry(pos, struct task_struct,
+						 lmk_node);
+				if (tsk->flags & PF_KTHREAD)
+					continue;
+				/* one may have been reaped, and be waiting on our lock */
+				if (atomic_inc_not_zero(&tsk->usage))
+					batch[nr_batch++] = tsk;
 			}
-		} else if (selected_oom_adj[max_selected_oom_idx] < oom_adj ||
-			(selected_oom_adj[max_selected_oom_idx] == oom_adj &&
-			selected_tasksize[max_selected_oom_idx] < tasksize)) {
-			is_exist_oom_task = 1;
-		}
+			if (pos == bucket) {
+				done = true;
+			} else {
+				/* our batch ref keeps it until we take our own */
+				cursor = batch[nr_batch - 1];
+				cursor_seq = cursor->lmk_seq;
+				get_task_struct(cursor);
+			}
+			spin_unlock_irqrestore(&lowmem_bucket_lock, flags);
+			if (last)
+				put_task_struct(last);
+
+			for (b = 0; b < nr_batch; b++) {
+				struct task_struct *p;
+
+				tsk = batch[b];
+				/*
+				 * A rescan from the head, or a task re-filed
+				 * from a bucket already scanned, is seen again.
+				 */
+				for (i = 0; i < nr_selected; i++)
+					if (selected[i] == tsk)
+						break;
+				if (i < nr_selected) {
+					put_task_struct(tsk);
+					continue;
+				}
+				p = find_lock_task_mm(tsk);
+				if (!p) {
+					put_task_struct(tsk);
+					continue;
+				}
+				tasksize = get_mm_rss(p->mm);
+				task_unlock(p);
+				if (tasksize <= 0) {
+					put_task_struct(tsk);
+					continue;
+				}
 
-		if (is_exist_oom_task) {
-			selected[max_selected_oom_idx] = p;
-			selected_tasksize[max_selected_oom_idx] = tasksize;
-			selected_oom_adj[max_selected_oom_idx] = oom_adj;
-
-			if (all_selected_oom < LOWMEM_DEATHPENDING_DEPTH)
-				all_selected_oom++;
-
-			if (all_selected_oom == LOWMEM_DEATHPENDING_DEPTH) {
-				for (i = 0; i < LOWMEM_DEATHPENDING_DEPTH; i++) {
-					if (selected_oom_adj[i] < selected_oom_adj[max_selected_oom_idx])
-						max_selected_oom_idx = i;
-					else if (selected_oom_adj[i] == selected_oom_adj[max_selected_oom_idx] &&
-						selected_tasksize[i] < selected_tasksize[max_selected_oom_idx])
-						max_selected_oom_idx = i;
+				if (nr_selected < LOWMEM_DEATHPENDING_DEPTH) {
+					i = nr_selected++;
+				} else {
+					int j;
+
+					/* replace the smallest of this bucket's picks */
+					i = first;
+					for (j = first + 1; j < nr_selected; j++)
+						if (selected_tasksize[j] <
+						    selected_tasksize[i])
+							i = j;
+					if (selected_tasksize[i] >= tasksize) {
+						put_task_struct(tsk);
+						continue;
+					}
+					put_task_struct(selected[i]);
 				}
+				selected[i] = tsk;
+				selected_tasksize[i] = tasksize;
+				selected_oom_adj[i] = adj;
+				lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+					     tsk->pid, tsk->comm, adj, tasksize);
 			}
-
-			lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-				p->pid, p->comm, oom_adj, tasksize);
-		}
-#else
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
-				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
 		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
-#endif
 	}
-#ifdef ENHANCED_LMK_ROUTINE
-	for (i = 0; i < LOWMEM_DEATHPENDING_DEPTH; i++) {
-		if (selected[i]) {
-			lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
-				selected[i]->pid, selected[i]->comm,
-				selected_oom_adj[i], selected_tasksize[i]);
-			lowmem_deathpending[i] = selected[i];
-			lowmem_deathpending_timeout = jiffies + HZ;
-			force_sig(SIGKILL, selected[i]);
-			rem -= selected_tasksize[i];
-		}
+
+	delta = ktime_to_ns(ktime_sub(ktime_get(), start));
+	spin_lock_irqsave(&lowmem_bucket_lock, flags);
+	lowmem_stats.selections++;
+	lowmem_stats.select_ns_total += delta;
+	lowmem_stats.select_ns_last = delta;
+	if (delta > lowmem_stats.select_ns_max)
+		lowmem_stats.select_ns_max = delta;
+	for (i = 0; i < nr_selected; i++) {
+		lowmem_stats.kills++;
+		if (pressure_kill)
+			lowmem_stats.pressure_kills++;
+		lowmem_stats.adj_kills[selected_oom_adj[i] - OOM_DISABLE]++;
 	}
-#else
-	if (selected) {
+	spin_unlock_irqrestore(&lowmem_bucket_lock, flags);
+
+	for (i = 0; i < nr_selected; i++) {
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
-			     selected->pid, selected->comm,
-			     selected_oom_adj, selected_tasksize);
-		lowmem_deathpending = selected;
+			     selected[i]->pid, selected[i]->comm,
+			     selected_oom_adj[i], selected_tasksize[i]);
+		lowmem_deathpending[i] = selected[i];
 		lowmem_deathpending_timeout = jiffies + HZ;
-		send_sig(SIGKILL, selected, 0);
-		rem -= selected_tasksize;
+		send_sig(SIGKILL, selected[i], 0);
+		rem -= selected_tasksize[i];
+		put_task_struct(selected[i]);
+	}
+	/* re-arm: only keep killing if pressure stays high */
+	if (pressure_kill && nr_selected) {
+		spin_lock(&lowmem_vmpressure_lock);
+		lowmem_under_pressure = false;
+		lowmem_vmpressure_run = 0;
+		spin_unlock(&lowmem_vmpressure_lock);
 	}
-#endif
 	lowmem_print(4, "lowmem_shrink %lu, %x, return %d\n",
 		     sc->nr_to_scan, sc->gfp_mask, rem);
-	rcu_read_unlock();
 	return rem;
 }
 
@@ -318,6 +473,97 @@ static struct shrinker lowmem_shrinker = {
 	.seeks = DEFAULT_SEEKS * 16
 };
 
+static void __init lowmem_index_init(void)
+{
+	struct task_struct *p;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&lowmem_bucket_lock, flags);
+	for (i = 0; i < LOWMEM_ADJ_BUCKETS; i++)
+		INIT_LIST_HEAD(&lowmem_buckets[i]);
+	lowmem_index_ready = true;
+	spin_unlock_irqrestore(&lowmem_bucket_lock, flags);
+
+	/* pick up everything forked before we were ready */
+	read_lock(&tasklist_lock);
+	for_each_process(p)
+		lowmem_task_update(p);
+	read_unlock(&tasklist_lock);
+}
+
+#ifdef CONFIG_DEBUG_FS
+static int lowmem_stats_show(struct seq_file *m, void *unused)
+{
+	struct task_struct *tsk;
+	unsigned long flags;
+	u64 avg = 0;
+	int adj, nr;
+
+	spin_lock_irqsave(&lowmem_bucket_lock, flags);
+	if (lowmem_stats.selections) {
+		avg = lowmem_stats.select_ns_total;
+		do_div(avg, lowmem_stats.selections);
+	}
+	seq_printf(m, "selections: %llu\n", lowmem_stats.selections);
+	seq_printf(m, "select_ns: last %llu avg %llu max %llu\n",
+		   lowmem_stats.select_ns_last, avg, lowmem_stats.select_ns_max);
+	seq_printf(m, "kills: %llu\n", lowmem_stats.kills);
+	seq_printf(m, "vmpressure: last %lu%s, kills %llu\n",
+		   lowmem_vmpressure_last,
+		   lowmem_under_pressure ? " (under pressure)" : "",
+		   lowmem_stats.pressure_kills);
+	seq_printf(m, "%4s %6s %8s\n", "adj", "tasks", "kills");
+	for (adj = OOM_DISABLE; adj <= OOM_ADJUST_MAX; adj++) {
+		nr = 0;
+		list_for_each_entry(tsk, lowmem_bucket(adj), lmk_node)
+			nr++;
+		if (!nr && !lowmem_stats.adj_kills[adj - OOM_DISABLE])
+			continue;
+		seq_printf(m, "%4d %6d %8llu\n", adj, nr,
+			   lowmem_stats.adj_kills[adj - OOM_DISABLE]);
+	}
+	spin_unlock_irqrestore(&lowmem_bucket_lock, flags);
+	return 0;
+}
+
+static int lowmem_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lowmem_stats_show, NULL);
+}
+
+static const struct file_operations lowmem_stats_fops = {
+	.open		= lowmem_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static struct dentry *lowmem_debugfs_root;
+
+static void __init lowmem_debugfs_init(void)
+{
+	lowmem_debugfs_root = debugfs_create_dir("lowmemorykiller", NULL);
+	if (IS_ERR_OR_NULL(lowmem_debugfs_root))
+		return;
+	debugfs_create_file("stats", S_IRUGO, lowmem_debugfs_root, NULL,
+			    &lowmem_stats_fops);
+}
+
+static void lowmem_debugfs_exit(void)
+{
+	debugfs_remove_recursive(lowmem_debugfs_root);
+}
+#else
+static inline void lowmem_debugfs_init(void)
+{
+}
+
+static inline void lowmem_debugfs_exit(void)
+{
+}
+#endif
+
 #ifdef CONFIG_ZRAM_FOR_ANDROID
 /*
  * zone_id_shrink_pagelist() clear page flags,
@@ -514,7 +760,10 @@ static int __init lowmem_init(void)
 	unsigned int high_wmark = 0;
 #endif
 	task_free_register(&task_nb);
+	lowmem_index_init();
 	register_shrinker(&lowmem_shrinker);
+	vmpressure_notifier_register(&lowmem_vmpressure_nb);
+	lowmem_debugfs_init();
 
 #ifdef CONFIG_ZRAM_FOR_ANDROID
 	for_each_zone(zone) {
@@ -545,6 +794,8 @@ static int __init lowmem_init(void)
 
 static void __exit lowmem_exit(void)
 {
+	lowmem_debugfs_exit();
+	vmpressure_notifier_unregister(&lowmem_vmpressure_nb);
 	unregister_shrinker(&lowmem_shrinker);
 	task_free_unregister(&task_nb);
 }
@@ -555,6 +806,14 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(vmpressure_kill, lowmem_vmpressure_kill, int,
+		   S_IRUGO | S_IWUSR);
+module_param_named(vmpressure_high, lowmem_vmpressure_high, int,
+		   S_IRUGO | S_IWUSR);
+module_param_named(vmpressure_low, lowmem_vmpressure_low, int,
+		   S_IRUGO | S_IWUSR);
+module_param_named(vmpressure_windows, lowmem_vmpressure_windows, int,
+		   S_IRUGO | S_IWUSR);
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
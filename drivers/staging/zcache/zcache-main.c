@@ -1,5 +1,5 @@
 /*
- * zcache.c
+ * zcache-main.c
  *
  * Copyright (c) 2010,2011, Dan Magenheimer, Oracle Corp.
  * Copyright (c) 2010,2011, Nitin Gupta
@@ -8,9 +8,9 @@
  * and, thus indirectly, for cleancache and frontswap.  Zcache includes two
  * page-accessible memory [1] interfaces, both utilizing lzo1x compression:
  * 1) "compression buddies" ("zbud") is used for ephemeral pages
- * 2) xvmalloc is used for persistent pages.
- * Xvmalloc (based on the TLSF allocator) has very low fragmentation
- * so maximizes space efficiency, while zbud allows pairs (and potentially,
+ * 2) zsmalloc is used for persistent pages.
+ * Zsmalloc has very low fragmentation so maximizes space efficiency,
+ * while zbud allows pairs (and potentially,
  * in the future, more than a pair of) compressed pages to be closely linked
  * so that reclaiming can be done via the kernel's physical-page-oriented
  * "shrinker" interface.
@@ -25,11 +25,12 @@
 #include <linux/lzo.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
+#include <linux/workqueue.h>
 #include <linux/types.h>
 #include <linux/atomic.h>
 #include "tmem.h"
 
-#include "../zram/xvmalloc.h" /* if built in drivers/staging */
+#include "../zsmalloc/zsmalloc.h"
 
 #if (!defined(CONFIG_CLEANCACHE) && !defined(CONFIG_FRONTSWAP))
 #error "zcache is useless without CONFIG_CLEANCACHE or CONFIG_FRONTSWAP"
@@ -49,6 +50,32 @@
 	(__GFP_FS | __GFP_NORETRY | __GFP_NOWARN | __GFP_NOMEMALLOC)
 #endif
 
+/* used to top up the per-cpu preloads from process context */
+#define ZCACHE_REFILL_GFP_MASK \
+	(GFP_KERNEL | __GFP_NORETRY | __GFP_NOWARN | __GFP_NOMEMALLOC)
+
+/*
+ * zcache wraps each tmem_pool to add its own per-pool policy.  Ephemeral
+ * pools keep their zbuds on an LRU list, oldest first, and are held to
+ * max_pages by evicting from the head of that list.  Persistent pools
+ * cannot drop data, so hitting max_pages simply fails the put; their
+ * pages live in a zsmalloc pool of their own.
+ */
+struct zcache_pool {
+	struct tmem_pool tmem;
+	atomic_t pages;			/* compressed pages currently held */
+	unsigned long max_pages;	/* zero means no limit */
+	unsigned long evicted;		/* pages evicted to honour max_pages */
+	struct list_head eph_lru;	/* ephemeral only, of zbud_hdr.lru */
+	struct zs_pool *zspool;		/* persistent only */
+	char zs_name[16];
+};
+
+#define zcache_pool(_p) container_of(_p, struct zcache_pool, tmem)
+
+/* protects every pool's eph_lru; nests inside zbpg->lock */
+static DEFINE_SPINLOCK(zcache_eph_lru_lock);
+
 /**********
  * Compression buddies ("zbud") provides for packing two (or, possibly
  * in the future, more) compressed ephemeral pages into a single "raw"
@@ -76,6 +103,7 @@ struct zbud_hdr {
 	struct tmem_oid oid;
 	uint32_t index;
 	uint16_t size; /* compressed size in bytes, zero means unused */
+	struct list_head lru; /* on the owning pool's eph_lru while in use */
 	DECL_SENTINEL
 };
 
@@ -251,6 +279,9 @@ static unsigned zbud_free(struct zbud_hdr *zh)
 	BUG_ON(zh->size == 0 || zh->size > zbud_max_buddy_size());
 	zh->size = 0;
 	tmem_oid_set_invalid(&zh->oid);
+	spin_lock(&zcache_eph_lru_lock);
+	list_del_init(&zh->lru);
+	spin_unlock(&zcache_eph_lru_lock);
 	INVERT_SENTINEL(zh, ZBH);
 	zcache_zbud_curr_zbytes -= size;
 	atomic_dec(&zcache_zbud_curr_zpages);
@@ -294,7 +325,8 @@ static void zbud_free_and_delist(struct zbud_hdr *zh)
 	}
 }
 
-static struct zbud_hdr *zbud_create(uint32_t pool_id, struct tmem_oid *oid,
+static struct zbud_hdr *zbud_create(struct zcache_pool *zpool,
+					struct tmem_oid *oid,
 					uint32_t index, struct page *page,
 					void *cdata, unsigned size)
 {
@@ -352,9 +384,12 @@ init_zh:
 	zh->size = size;
 	zh->index = index;
 	zh->oid = *oid;
-	zh->pool_id = pool_id;
+	zh->pool_id = zpool->tmem.pool_id;
 	/* can wait to copy the data until the list locks are dropped */
 	spin_unlock(&zbud_budlists_spinlock);
+	spin_lock(&zcache_eph_lru_lock);
+	list_add_tail(&zh->lru, &zpool->eph_lru);
+	spin_unlock(&zcache_eph_lru_lock);
 
 	to = zbud_data(zh, size);
 	memcpy(to, cdata, size);
@@ -386,13 +421,13 @@ static int zbud_decompress(struct page *page, struct zbud_hdr *zh)
 	}
 	ASSERT_SENTINEL(zh, ZBH);
 	BUG_ON(zh->size == 0 || zh->size > zbud_max_buddy_size());
-	to_va = kmap_atomic(page, KM_USER0);
+	to_va = kmap_atomic(page);
 	size = zh->size;
 	from_va = zbud_data(zh, size);
 	ret = lzo1x_decompress_safe(from_va, size, to_va, &out_len);
 	BUG_ON(ret != LZO_E_OK);
 	BUG_ON(out_len != PAGE_SIZE);
-	kunmap_atomic(to_va, KM_USER0);
+	kunmap_atomic(to_va);
 out:
 	spin_unlock(&zbpg->lock);
 	return ret;
@@ -406,6 +441,7 @@ out:
 static unsigned long zcache_evicted_raw_pages;
 static unsigned long zcache_evicted_buddied_pages;
 static unsigned long zcache_evicted_unbuddied_pages;
+static unsigned long zcache_evicted_lru_pages;
 
 static struct tmem_pool *zcache_get_pool_by_id(uint32_t poolid);
 static void zcache_put_pool(struct tmem_pool *pool);
@@ -446,6 +482,51 @@ static void zbud_evict_zbpg(struct zbud_page *zbpg)
 	zbud_free_raw_page(zbpg);
 }
 
+/*
+ * Evict the zbpg holding the oldest zbud of an ephemeral pool, along
+ * with its buddy if it has one.  Returns 1 if a zbpg was evicted, 0 if
+ * the pool is empty or its oldest zbpg is busy on another cpu.
+ */
+static int zbud_evict_lru(struct zcache_pool *zpool)
+{
+	struct zbud_hdr *zh, *zh_other;
+	struct zbud_page *zbpg;
+	unsigned budnum;
+
+	spin_lock(&zcache_eph_lru_lock);
+	if (list_empty(&zpool->eph_lru)) {
+		spin_unlock(&zcache_eph_lru_lock);
+		return 0;
+	}
+	zh = list_first_entry(&zpool->eph_lru, struct zbud_hdr, lru);
+	budnum = zbud_budnum(zh);
+	zbpg = container_of(zh, struct zbud_page, buddy[budnum]);
+	/* zbud_free() takes the lru lock inside zbpg->lock, so trylock */
+	if (unlikely(!spin_trylock(&zbpg->lock))) {
+		spin_unlock(&zcache_eph_lru_lock);
+		return 0;
+	}
+	spin_unlock(&zcache_eph_lru_lock);
+	/* zh was still listed, so zbpg can't be a zombie */
+	BUG_ON(list_empty(&zbpg->bud_list));
+	zh_other = &zbpg->buddy[(budnum == 0) ? 1 : 0];
+	spin_lock(&zbud_budlists_spinlock);
+	list_del_init(&zbpg->bud_list);
+	if (zh_other->size != 0) {
+		zcache_zbud_buddied_count--;
+		zcache_evicted_buddied_pages++;
+	} else {
+		zbud_unbuddied[zbud_size_to_chunks(zh->size)].count--;
+		zcache_evicted_unbuddied_pages++;
+	}
+	spin_unlock(&zbud_budlists_spinlock);
+	zbud_evict_zbpg(zbpg);
+	zpool->evicted++;
+	return 1;
+}
+
+static int zcache_evict_lru_pages(int nr);
+
 /*
  * Free nr pages.  This code is funky because we want to hold the locks
  * protecting various lists for as short a time as possible, and in some
@@ -478,6 +559,11 @@ retry_unused_list:
 	}
 	spin_unlock_bh(&zbpg_unused_list_spinlock);
 
+	/* then the oldest pages of each ephemeral pool */
+	nr = zcache_evict_lru_pages(nr);
+	if (nr <= 0)
+		goto out;
+
 	/* now try freeing unbuddied pages, starting with least space avail */
 	for (i = 0; i < MAX_CHUNK; i++) {
 retry_unbud_list_i:
@@ -585,12 +671,12 @@ static int zbud_show_cumul_chunk_counts(char *buf)
 #endif
 
 /**********
- * This "zv" PAM implementation combines the TLSF-based xvMalloc
- * with lzo1x compression to maximize the amount of data that can
- * be packed into a physical page.
+ * This "zv" PAM implementation combines zsmalloc with lzo1x compression
+ * to maximize the amount of data that can be packed into a physical page.
  *
  * Zv represents a PAM page with the index and object (plus a "size" value
  * necessary for decompression) immediately preceding the compressed data.
+ * The pampd handed to tmem is the zsmalloc handle, not a pointer.
  */
 
 #define ZVH_SENTINEL  0x43214321
@@ -599,68 +685,70 @@ struct zv_hdr {
 	uint32_t pool_id;
 	struct tmem_oid oid;
 	uint32_t index;
+	uint16_t size;
 	DECL_SENTINEL
 };
 
 static const int zv_max_page_size = (PAGE_SIZE / 8) * 7;
 
-static struct zv_hdr *zv_create(struct xv_pool *xvpool, uint32_t pool_id,
+static unsigned long zv_create(struct zs_pool *zspool, uint32_t pool_id,
 				struct tmem_oid *oid, uint32_t index,
 				void *cdata, unsigned clen)
 {
-	struct page *page;
-	struct zv_hdr *zv = NULL;
-	uint32_t offset;
-	int ret;
+	struct zv_hdr *zv;
+	unsigned long handle;
 
 	BUG_ON(!irqs_disabled());
-	ret = xv_malloc(xvpool, clen + sizeof(struct zv_hdr),
-			&page, &offset, ZCACHE_GFP_MASK);
-	if (unlikely(ret))
+	handle = zs_malloc(zspool, clen + sizeof(struct zv_hdr));
+	if (unlikely(!handle))
 		goto out;
-	zv = kmap_atomic(page, KM_USER0) + offset;
+	zv = zs_map_object(zspool, handle, ZS_MM_WO);
 	zv->index = index;
 	zv->oid = *oid;
 	zv->pool_id = pool_id;
+	zv->size = clen;
 	SET_SENTINEL(zv, ZVH);
 	memcpy((char *)zv + sizeof(struct zv_hdr), cdata, clen);
-	kunmap_atomic(zv, KM_USER0);
+	zs_unmap_object(zspool, handle);
 out:
-	return zv;
+	return handle;
 }
 
-static void zv_free(struct xv_pool *xvpool, struct zv_hdr *zv)
+static void zv_free(struct zs_pool *zspool, unsigned long handle)
 {
 	unsigned long flags;
-	struct page *page;
-	uint32_t offset;
+	struct zv_hdr *zv;
 	uint16_t size;
 
+	zv = zs_map_object(zspool, handle, ZS_MM_RW);
 	ASSERT_SENTINEL(zv, ZVH);
-	size = xv_get_object_size(zv) - sizeof(*zv);
+	size = zv->size;
 	BUG_ON(size == 0 || size > zv_max_page_size);
 	INVERT_SENTINEL(zv, ZVH);
-	page = virt_to_page(zv);
-	offset = (unsigned long)zv & ~PAGE_MASK;
+	zs_unmap_object(zspool, handle);
 	local_irq_save(flags);
-	xv_free(xvpool, page, offset);
+	zs_free(zspool, handle);
 	local_irq_restore(flags);
 }
 
-static void zv_decompress(struct page *page, struct zv_hdr *zv)
+static void zv_decompress(struct zs_pool *zspool, struct page *page,
+				unsigned long handle)
 {
 	size_t clen = PAGE_SIZE;
+	struct zv_hdr *zv;
 	char *to_va;
 	unsigned size;
 	int ret;
 
+	zv = zs_map_object(zspool, handle, ZS_MM_RO);
 	ASSERT_SENTINEL(zv, ZVH);
-	size = xv_get_object_size(zv) - sizeof(*zv);
+	size = zv->size;
 	BUG_ON(size == 0 || size > zv_max_page_size);
-	to_va = kmap_atomic(page, KM_USER0);
+	to_va = kmap_atomic(page);
 	ret = lzo1x_decompress_safe((char *)zv + sizeof(*zv),
 					size, to_va, &clen);
-	kunmap_atomic(to_va, KM_USER0);
+	kunmap_atomic(to_va);
+	zs_unmap_object(zspool, handle);
 	BUG_ON(ret != LZO_E_OK);
 	BUG_ON(clen != PAGE_SIZE);
 }
@@ -681,7 +769,6 @@ static unsigned long zcache_failed_pers_puts;
 
 static struct {
 	struct tmem_pool *tmem_pools[MAX_POOLS_PER_CLIENT];
-	struct xv_pool *xvpool;
 } zcache_client;
 
 /*
@@ -709,12 +796,84 @@ static void zcache_put_pool(struct tmem_pool *pool)
 		atomic_dec(&pool->refcount);
 }
 
+/*
+ * Default max_pages for new pools, set at init from the amount of RAM.
+ * 3/4 totalram_pages of persistent pages should allow ~37% of RAM to be
+ * filled with compressed frontswap pages.
+ */
+static unsigned long zcache_eph_pool_max_pages;
+static unsigned long zcache_pers_pool_max_pages;
+
+static void zcache_set_pool_limits(bool persistent, unsigned long max_pages)
+{
+	struct tmem_pool *pool;
+	int poolid;
+
+	for (poolid = 0; poolid < MAX_POOLS_PER_CLIENT; poolid++) {
+		pool = zcache_get_pool_by_id(poolid);
+		if (pool == NULL)
+			continue;
+		if (is_persistent(pool) == persistent)
+			zcache_pool(pool)->max_pages = max_pages;
+		zcache_put_pool(pool);
+	}
+}
+
+/*
+ * Shrinker side of the ephemeral policy: take the oldest zbpg from each
+ * ephemeral pool in turn until nr have gone or no pool can give one up.
+ * Returns how many of nr are left.
+ */
+static int zcache_evict_lru_pages(int nr)
+{
+	struct tmem_pool *pool;
+	int poolid, progress;
+
+	do {
+		progress = 0;
+		for (poolid = 0; poolid < MAX_POOLS_PER_CLIENT && nr > 0;
+								poolid++) {
+			pool = zcache_get_pool_by_id(poolid);
+			if (pool == NULL)
+				continue;
+			if (is_ephemeral(pool)) {
+				local_bh_disable();
+				if (zbud_evict_lru(zcache_pool(pool))) {
+					zcache_evicted_lru_pages++;
+					progress = 1;
+					nr--;
+				}
+				local_bh_enable();
+			}
+			zcache_put_pool(pool);
+		}
+	} while (nr > 0 && progress);
+	return nr;
+}
+
+/* bound on evictions a single put does to bring its pool under max_pages */
+#define ZCACHE_PUT_EVICT_MAX	4
+
+static void zcache_eph_enforce_limit(struct zcache_pool *zpool)
+{
+	int tries = ZCACHE_PUT_EVICT_MAX;
+
+	while (zpool->max_pages &&
+	       atomic_read(&zpool->pages) >= zpool->max_pages && tries--) {
+		if (!zbud_evict_lru(zpool))
+			break;
+		zcache_evicted_lru_pages++;
+	}
+}
+
 /* counters for debugging */
 static unsigned long zcache_failed_get_free_pages;
 static unsigned long zcache_failed_alloc;
 static unsigned long zcache_put_to_flush;
 static unsigned long zcache_aborted_preload;
 static unsigned long zcache_aborted_shrink;
+static unsigned long zcache_preload_misses;
+static unsigned long zcache_preload_refills;
 
 /*
  * Ensure that memory allocation requests in zcache don't result
@@ -738,7 +897,13 @@ static unsigned long zcache_curr_objnode_count_max;
 /*
  * to avoid memory allocation recursion (e.g. due to direct reclaim), we
  * preload all necessary data structures so the hostops callbacks never
- * actually do a malloc
+ * actually do a malloc.
+ *
+ * Puts arrive with interrupts off, so anything allocated there has to be
+ * an atomic allocation.  Instead, each put that drains its cpu's preload
+ * kicks a per-cpu work item which tops it up again from process context,
+ * and the next put normally finds everything already in place.  Only when
+ * puts outrun the refill does zcache_do_preload() allocate inline.
  */
 struct zcache_preload {
 	void *page;
@@ -747,6 +912,67 @@ struct zcache_preload {
 	struct tmem_objnode *objnodes[OBJNODE_TREE_MAX_PATH];
 };
 static DEFINE_PER_CPU(struct zcache_preload, zcache_preloads) = { 0, };
+static DEFINE_PER_CPU(struct work_struct, zcache_preload_work);
+
+static bool zcache_preload_full(struct zcache_preload *kp)
+{
+	return kp->nr == ARRAY_SIZE(kp->objnodes) &&
+		kp->obj != NULL && kp->page != NULL;
+}
+
+static void zcache_refill_preload(struct work_struct *work)
+{
+	struct tmem_objnode *objnodes[OBJNODE_TREE_MAX_PATH];
+	struct zcache_preload *kp;
+	struct tmem_obj *obj = NULL;
+	void *page = NULL;
+	unsigned long flags;
+	int nr = 0, need;
+	bool need_obj, need_page;
+
+	local_irq_save(flags);
+	kp = &__get_cpu_var(zcache_preloads);
+	need = ARRAY_SIZE(kp->objnodes) - kp->nr;
+	need_obj = kp->obj == NULL;
+	need_page = kp->page == NULL;
+	local_irq_restore(flags);
+
+	while (nr < need) {
+		objnodes[nr] = kmem_cache_alloc(zcache_objnode_cache,
+						ZCACHE_REFILL_GFP_MASK);
+		if (objnodes[nr] == NULL)
+			break;
+		nr++;
+	}
+	if (need_obj)
+		obj = kmem_cache_alloc(zcache_obj_cache,
+					ZCACHE_REFILL_GFP_MASK);
+	if (need_page)
+		page = (void *)__get_free_page(ZCACHE_REFILL_GFP_MASK);
+
+	/* may have migrated; whichever cpu we are on now gets them */
+	local_irq_save(flags);
+	kp = &__get_cpu_var(zcache_preloads);
+	while (nr > 0 && kp->nr < ARRAY_SIZE(kp->objnodes))
+		kp->objnodes[kp->nr++] = objnodes[--nr];
+	if (obj != NULL && kp->obj == NULL) {
+		kp->obj = obj;
+		obj = NULL;
+	}
+	if (page != NULL && kp->page == NULL) {
+		kp->page = page;
+		page = NULL;
+	}
+	zcache_preload_refills++;
+	local_irq_restore(flags);
+
+	while (nr > 0)
+		kmem_cache_free(zcache_objnode_cache, objnodes[--nr]);
+	if (obj != NULL)
+		kmem_cache_free(zcache_obj_cache, obj);
+	if (page != NULL)
+		free_page((unsigned long)page);
+}
 
 static int zcache_do_preload(struct tmem_pool *pool)
 {
@@ -760,6 +986,11 @@ static int zcache_do_preload(struct tmem_pool *pool)
 		goto out;
 	if (unlikely(zcache_obj_cache == NULL))
 		goto out;
+	preempt_disable();
+	if (likely(zcache_preload_full(&__get_cpu_var(zcache_preloads))))
+		return 0;
+	preempt_enable_no_resched();
+	zcache_preload_misses++;
 	if (!spin_trylock(&zcache_direct_reclaim_lock)) {
 		zcache_aborted_preload++;
 		goto out;
@@ -904,6 +1135,7 @@ static int zcache_compress(struct page *from, void **out_va, size_t *out_len);
 static void *zcache_pampd_create(struct tmem_pool *pool, struct tmem_oid *oid,
 				 uint32_t index, struct page *page)
 {
+	struct zcache_pool *zpool = zcache_pool(pool);
 	void *pampd = NULL, *cdata;
 	size_t clen;
 	int ret;
@@ -919,21 +1151,17 @@ static void *zcache_pampd_create(struct tmem_pool *pool, struct tmem_oid *oid,
 			zcache_compress_poor++;
 			goto out;
 		}
-		pampd = (void *)zbud_create(pool->pool_id, oid, index,
+		pampd = (void *)zbud_create(zpool, oid, index,
 						page, cdata, clen);
 		if (pampd != NULL) {
+			atomic_inc(&zpool->pages);
 			count = atomic_inc_return(&zcache_curr_eph_pampd_count);
 			if (count > zcache_curr_eph_pampd_count_max)
 				zcache_curr_eph_pampd_count_max = count;
 		}
 	} else {
-		/*
-		 * FIXME: This is all the "policy" there is for now.
-		 * 3/4 totpages should allow ~37% of RAM to be filled with
-		 * compressed frontswap pages
-		 */
-		if (atomic_read(&zcache_curr_pers_pampd_count) >
-							3 * totalram_pages / 4)
+		if (zpool->max_pages &&
+		    atomic_read(&zpool->pages) >= zpool->max_pages)
 			goto out;
 		ret = zcache_compress(page, &cdata, &clen);
 		if (ret == 0)
@@ -942,10 +1170,11 @@ static void *zcache_pampd_create(struct tmem_pool *pool, struct tmem_oid *oid,
 			zcache_compress_poor++;
 			goto out;
 		}
-		pampd = (void *)zv_create(zcache_client.xvpool, pool->pool_id,
+		pampd = (void *)zv_create(zpool->zspool, pool->pool_id,
 						oid, index, cdata, clen);
 		if (pampd == NULL)
 			goto out;
+		atomic_inc(&zpool->pages);
 		count = atomic_inc_return(&zcache_curr_pers_pampd_count);
 		if (count > zcache_curr_pers_pampd_count_max)
 			zcache_curr_pers_pampd_count_max = count;
@@ -966,7 +1195,8 @@ static int zcache_pampd_get_data(struct page *page, void *pampd,
 	if (is_ephemeral(pool))
 		ret = zbud_decompress(page, pampd);
 	else
-		zv_decompress(page, pampd);
+		zv_decompress(zcache_pool(pool)->zspool, page,
+				(unsigned long)pampd);
 	return ret;
 }
 
@@ -976,12 +1206,15 @@ static int zcache_pampd_get_data(struct page *page, void *pampd,
  */
 static void zcache_pampd_free(void *pampd, struct tmem_pool *pool)
 {
+	struct zcache_pool *zpool = zcache_pool(pool);
+
+	atomic_dec(&zpool->pages);
 	if (is_ephemeral(pool)) {
 		zbud_free_and_delist((struct zbud_hdr *)pampd);
 		atomic_dec(&zcache_curr_eph_pampd_count);
 		BUG_ON(atomic_read(&zcache_curr_eph_pampd_count) < 0);
 	} else {
-		zv_free(zcache_client.xvpool, (struct zv_hdr *)pampd);
+		zv_free(zpool->zspool, (unsigned long)pampd);
 		atomic_dec(&zcache_curr_pers_pampd_count);
 		BUG_ON(atomic_read(&zcache_curr_pers_pampd_count) < 0);
 	}
@@ -1012,12 +1245,12 @@ static int zcache_compress(struct page *from, void **out_va, size_t *out_len)
 	BUG_ON(!irqs_disabled());
 	if (unlikely(dmem == NULL || wmem == NULL))
 		goto out;  /* no buffer, so can't compress */
-	from_va = kmap_atomic(from, KM_USER0);
+	from_va = kmap_atomic(from);
 	mb();
 	ret = lzo1x_1_compress(from_va, PAGE_SIZE, dmem, out_len, wmem);
 	BUG_ON(ret != LZO_E_OK);
 	*out_va = dmem;
-	kunmap_atomic(from_va, KM_USER0);
+	kunmap_atomic(from_va);
 	ret = 1;
 out:
 	return ret;
@@ -1046,6 +1279,7 @@ static int zcache_cpu_notifier(struct notifier_block *nb,
 		per_cpu(zcache_dstmem, cpu) = NULL;
 		kfree(per_cpu(zcache_workmem, cpu));
 		per_cpu(zcache_workmem, cpu) = NULL;
+		cancel_work_sync(&per_cpu(zcache_preload_work, cpu));
 		kp = &per_cpu(zcache_preloads, cpu);
 		while (kp->nr) {
 			kmem_cache_free(zcache_objnode_cache,
@@ -1053,8 +1287,11 @@ static int zcache_cpu_notifier(struct notifier_block *nb,
 			kp->objnodes[kp->nr - 1] = NULL;
 			kp->nr--;
 		}
-		kmem_cache_free(zcache_obj_cache, kp->obj);
+		if (kp->obj)
+			kmem_cache_free(zcache_obj_cache, kp->obj);
+		kp->obj = NULL;
 		free_page((unsigned long)kp->page);
+		kp->page = NULL;
 		break;
 	default:
 		break;
@@ -1067,6 +1304,29 @@ static struct notifier_block zcache_cpu_notifier_block = {
 };
 
 #ifdef CONFIG_SYSFS
+static int zcache_show_pools(char *buf)
+{
+	struct tmem_pool *pool;
+	struct zcache_pool *zpool;
+	char *p = buf;
+	int poolid;
+
+	p += sprintf(p, "%4s %-10s %10s %10s %10s\n",
+			"id", "type", "pages", "max_pages", "evicted");
+	for (poolid = 0; poolid < MAX_POOLS_PER_CLIENT; poolid++) {
+		pool = zcache_get_pool_by_id(poolid);
+		if (pool == NULL)
+			continue;
+		zpool = zcache_pool(pool);
+		p += sprintf(p, "%4d %-10s %10d %10lu %10lu\n", poolid,
+			is_persistent(pool) ? "persistent" : "ephemeral",
+			atomic_read(&zpool->pages), zpool->max_pages,
+			zpool->evicted);
+		zcache_put_pool(pool);
+	}
+	return p - buf;
+}
+
 #define ZCACHE_SYSFS_RO(_name) \
 	static ssize_t zcache_##_name##_show(struct kobject *kobj, \
 				struct kobj_attribute *attr, char *buf) \
@@ -1121,6 +1381,9 @@ ZCACHE_SYSFS_RO(failed_alloc);
 ZCACHE_SYSFS_RO(put_to_flush);
 ZCACHE_SYSFS_RO(aborted_preload);
 ZCACHE_SYSFS_RO(aborted_shrink);
+ZCACHE_SYSFS_RO(preload_misses);
+ZCACHE_SYSFS_RO(preload_refills);
+ZCACHE_SYSFS_RO(evicted_lru_pages);
 ZCACHE_SYSFS_RO(compress_poor);
 ZCACHE_SYSFS_RO_ATOMIC(zbud_curr_raw_pages);
 ZCACHE_SYSFS_RO_ATOMIC(zbud_curr_zpages);
@@ -1130,6 +1393,38 @@ ZCACHE_SYSFS_RO_CUSTOM(zbud_unbuddied_list_counts,
 			zbud_show_unbuddied_list_counts);
 ZCACHE_SYSFS_RO_CUSTOM(zbud_cumul_chunk_counts,
 			zbud_show_cumul_chunk_counts);
+ZCACHE_SYSFS_RO_CUSTOM(pools, zcache_show_pools);
+
+/*
+ * Writing a pool limit sets the default for pools created later and
+ * applies it to every existing pool of that kind.
+ */
+#define ZCACHE_SYSFS_POOL_LIMIT(_name, _persistent) \
+	static ssize_t zcache_##_name##_show(struct kobject *kobj, \
+				struct kobj_attribute *attr, char *buf) \
+	{ \
+		return sprintf(buf, "%lu\n", zcache_##_name); \
+	} \
+	static ssize_t zcache_##_name##_store(struct kobject *kobj, \
+				struct kobj_attribute *attr, \
+				const char *buf, size_t count) \
+	{ \
+		unsigned long val; \
+		int err = strict_strtoul(buf, 10, &val); \
+		if (err) \
+			return err; \
+		zcache_##_name = val; \
+		zcache_set_pool_limits(_persistent, val); \
+		return count; \
+	} \
+	static struct kobj_attribute zcache_##_name##_attr = { \
+		.attr = { .name = __stringify(_name), .mode = 0644 }, \
+		.show = zcache_##_name##_show, \
+		.store = zcache_##_name##_store, \
+	}
+
+ZCACHE_SYSFS_POOL_LIMIT(eph_pool_max_pages, false);
+ZCACHE_SYSFS_POOL_LIMIT(pers_pool_max_pages, true);
 
 static struct attribute *zcache_attrs[] = {
 	&zcache_curr_obj_count_attr.attr,
@@ -1158,6 +1453,12 @@ static struct attribute *zcache_attrs[] = {
 	&zcache_put_to_flush_attr.attr,
 	&zcache_aborted_preload_attr.attr,
 	&zcache_aborted_shrink_attr.attr,
+	&zcache_preload_misses_attr.attr,
+	&zcache_preload_refills_attr.attr,
+	&zcache_evicted_lru_pages_attr.attr,
+	&zcache_eph_pool_max_pages_attr.attr,
+	&zcache_pers_pool_max_pages_attr.attr,
+	&zcache_pools_attr.attr,
 	&zcache_zbud_unbuddied_list_counts_attr.attr,
 	&zcache_zbud_cumul_chunk_counts_attr.attr,
 	NULL,
@@ -1222,6 +1523,8 @@ static int zcache_put_page(int pool_id, struct tmem_oid *oidp,
 	pool = zcache_get_pool_by_id(pool_id);
 	if (unlikely(pool == NULL))
 		goto out;
+	if (!zcache_freeze && is_ephemeral(pool))
+		zcache_eph_enforce_limit(zcache_pool(pool));
 	if (!zcache_freeze && zcache_do_preload(pool) == 0) {
 		/* preload does preempt_disable on success */
 		ret = tmem_put(pool, oidp, index, page);
@@ -1232,6 +1535,9 @@ static int zcache_put_page(int pool_id, struct tmem_oid *oidp,
 				zcache_failed_pers_puts++;
 		}
 		zcache_put_pool(pool);
+		if (!zcache_preload_full(&__get_cpu_var(zcache_preloads)))
+			schedule_work_on(smp_processor_id(),
+					&__get_cpu_var(zcache_preload_work));
 		preempt_enable_no_resched();
 	} else {
 		zcache_put_to_flush++;
@@ -1304,6 +1610,7 @@ static int zcache_flush_object(int pool_id, struct tmem_oid *oidp)
 
 static int zcache_destroy_pool(int pool_id)
 {
+	struct zcache_pool *zpool;
 	struct tmem_pool *pool = NULL;
 	int ret = -1;
 
@@ -1319,7 +1626,10 @@ static int zcache_destroy_pool(int pool_id)
 	local_bh_disable();
 	ret = tmem_destroy_pool(pool);
 	local_bh_enable();
-	kfree(pool);
+	zpool = zcache_pool(pool);
+	if (zpool->zspool != NULL)
+		zs_destroy_pool(zpool->zspool);
+	kfree(zpool);
 	pr_info("zcache: destroyed pool id=%d\n", pool_id);
 out:
 	return ret;
@@ -1328,23 +1638,41 @@ out:
 static int zcache_new_pool(uint32_t flags)
 {
 	int poolid = -1;
+	struct zcache_pool *zpool;
 	struct tmem_pool *pool;
 
-	pool = kmalloc(sizeof(struct tmem_pool), GFP_KERNEL);
-	if (pool == NULL) {
+	zpool = kzalloc(sizeof(struct zcache_pool), GFP_KERNEL);
+	if (zpool == NULL) {
 		pr_info("zcache: pool creation failed: out of memory\n");
 		goto out;
 	}
+	pool = &zpool->tmem;
 
 	for (poolid = 0; poolid < MAX_POOLS_PER_CLIENT; poolid++)
 		if (zcache_client.tmem_pools[poolid] == NULL)
 			break;
 	if (poolid >= MAX_POOLS_PER_CLIENT) {
 		pr_info("zcache: pool creation failed: max exceeded\n");
-		kfree(pool);
+		kfree(zpool);
 		poolid = -1;
 		goto out;
 	}
+	INIT_LIST_HEAD(&zpool->eph_lru);
+	if (flags & TMEM_POOL_PERSIST) {
+		snprintf(zpool->zs_name, sizeof(zpool->zs_name),
+				"zcache%d", poolid);
+		zpool->zspool = zs_create_pool(zpool->zs_name,
+					ZCACHE_GFP_MASK | __GFP_HIGHMEM);
+		if (zpool->zspool == NULL) {
+			pr_info("zcache: pool creation failed: no zspool\n");
+			kfree(zpool);
+			poolid = -1;
+			goto out;
+		}
+		zpool->max_pages = zcache_pers_pool_max_pages;
+	} else
+		zpool->max_pages = zcache_eph_pool_max_pages;
+	atomic_set(&zpool->pages, 0);
 	atomic_set(&pool->refcount, 0);
 	pool->client = &zcache_client;
 	pool->pool_id = poolid;
@@ -1607,6 +1935,11 @@ static int __init zcache_init(void)
 	if (zcache_enabled) {
 		unsigned int cpu;
 
+		zcache_eph_pool_max_pages = totalram_pages / 4;
+		zcache_pers_pool_max_pages = 3 * totalram_pages / 4;
+		for_each_possible_cpu(cpu)
+			INIT_WORK(&per_cpu(zcache_preload_work, cpu),
+					zcache_refill_preload);
 		tmem_register_hostops(&zcache_hostops);
 		tmem_register_pamops(&zcache_pamops);
 		ret = register_cpu_notifier(&zcache_cpu_notifier_block);
@@ -1642,14 +1975,9 @@ static int __init zcache_init(void)
 	if (zcache_enabled && use_frontswap) {
 		struct frontswap_ops old_ops;
 
-		zcache_client.xvpool = xv_create_pool();
-		if (zcache_client.xvpool == NULL) {
-			pr_err("zcache: can't create xvpool\n");
-			goto out;
-		}
 		old_ops = zcache_frontswap_register_ops();
 		pr_info("zcache: frontswap enabled using kernel "
-			"transcendent memory and xvmalloc\n");
+			"transcendent memory and zsmalloc\n");
 		if (old_ops.init != NULL)
 			pr_warning("ktmem: frontswap_ops overridden");
 	}
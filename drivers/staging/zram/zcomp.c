@@ -0,0 +1,212 @@
+/*
+ * Compressed RAM block device - compression streams
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#define KMSG_COMPONENT "zram"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/err.h>
+#include <linux/percpu.h>
+#include <linux/gfp.h>
+
+#include "zcomp.h"
+
+/* Algorithms zram knows how to drive through the crypto compress API */
+static const char * const backends[] = {
+	"lzo",
+	"lz4",
+	"deflate",
+	NULL
+};
+
+/*
+ * Only report backends the crypto API can actually provide, either
+ * built in or as a loadable module.
+ */
+static bool zcomp_backend_present(const char *name)
+{
+	return crypto_has_comp(name, 0, 0) == 1;
+}
+
+bool zcomp_available_algorithm(const char *comp)
+{
+	int i;
+
+	for (i = 0; backends[i]; i++) {
+		if (sysfs_streq(comp, backends[i]))
+			return zcomp_backend_present(backends[i]);
+	}
+
+	return false;
+}
+
+/* show available compressors, the current one is in [] */
+ssize_t zcomp_available_show(const char *comp, char *buf)
+{
+	ssize_t sz = 0;
+	int i;
+
+	for (i = 0; backends[i]; i++) {
+		if (!zcomp_backend_present(backends[i]))
+			continue;
+
+		if (!strcmp(comp, backends[i]))
+			sz += scnprintf(buf + sz, PAGE_SIZE - sz - 2,
+					"[%s] ", backends[i]);
+		else
+			sz += scnprintf(buf + sz, PAGE_SIZE - sz - 2,
+					"%s ", backends[i]);
+	}
+
+	sz += scnprintf(buf + sz, PAGE_SIZE - sz, "\n");
+	return sz;
+}
+
+static void zcomp_strm_free(struct zcomp_strm *zstrm)
+{
+	if (!IS_ERR_OR_NULL(zstrm->tfm))
+		crypto_free_comp(zstrm->tfm);
+	free_pages((unsigned long)zstrm->buffer, 1);
+	zstrm->tfm = NULL;
+	zstrm->buffer = NULL;
+}
+
+static int zcomp_strm_init(struct zcomp *comp, struct zcomp_strm *zstrm)
+{
+	mutex_init(&zstrm->lock);
+
+	zstrm->tfm = crypto_alloc_comp(comp->name, 0, 0);
+	/*
+	 * allocate 2 pages. 1 for compressed data, plus 1 extra for the
+	 * case when compressed size is larger than the original one
+	 */
+	zstrm->buffer = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
+	if (IS_ERR(zstrm->tfm) || !zstrm->buffer) {
+		int ret = IS_ERR(zstrm->tfm) ? PTR_ERR(zstrm->tfm) : -ENOMEM;
+
+		zcomp_strm_free(zstrm);
+		return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Get the stream of the local CPU. The caller may sleep or migrate while
+ * holding it; in that case a writer on the old CPU briefly waits on the
+ * stream mutex instead of every writer waiting on a device-wide lock.
+ */
+struct zcomp_strm *zcomp_strm_find(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm;
+
+	zstrm = per_cpu_ptr(comp->stream, raw_smp_processor_id());
+	mutex_lock(&zstrm->lock);
+
+	return zstrm;
+}
+
+void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *zstrm)
+{
+	mutex_unlock(&zstrm->lock);
+}
+
+int zcomp_compress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, size_t *dst_len)
+{
+	int ret;
+	/* our dst buffer is 2 pages, see zcomp_strm_init() */
+	unsigned int len = PAGE_SIZE * 2;
+
+	ret = crypto_comp_compress(zstrm->tfm, src, PAGE_SIZE,
+				   zstrm->buffer, &len);
+	*dst_len = len;
+
+	return ret;
+}
+
+/* Must be called with preemption disabled */
+int zcomp_decompress(struct zcomp *comp, const unsigned char *src,
+		size_t src_len, unsigned char *dst)
+{
+	unsigned int dst_len = PAGE_SIZE;
+	struct crypto_comp *tfm;
+
+	tfm = *per_cpu_ptr(comp->dtfm, smp_processor_id());
+
+	return crypto_comp_decompress(tfm, src, src_len, dst, &dst_len);
+}
+
+void zcomp_destroy(struct zcomp *comp)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		if (comp->dtfm) {
+			struct crypto_comp *tfm = *per_cpu_ptr(comp->dtfm, cpu);
+
+			if (!IS_ERR_OR_NULL(tfm))
+				crypto_free_comp(tfm);
+		}
+		if (comp->stream)
+			zcomp_strm_free(per_cpu_ptr(comp->stream, cpu));
+	}
+
+	free_percpu(comp->dtfm);
+	free_percpu(comp->stream);
+	kfree(comp);
+}
+
+/*
+ * Create one compression stream and one decompression transform per
+ * possible CPU for the given algorithm. Returns an ERR_PTR() on failure.
+ */
+struct zcomp *zcomp_create(const char *compress)
+{
+	int cpu, ret;
+	struct zcomp *comp;
+
+	if (!zcomp_available_algorithm(compress))
+		return ERR_PTR(-ENOENT);
+
+	comp = kzalloc(sizeof(*comp), GFP_KERNEL);
+	if (!comp)
+		return ERR_PTR(-ENOMEM);
+
+	comp->name = compress;
+	comp->stream = alloc_percpu(struct zcomp_strm);
+	comp->dtfm = alloc_percpu(struct crypto_comp *);
+	ret = -ENOMEM;
+	if (!comp->stream || !comp->dtfm)
+		goto fail;
+
+	for_each_possible_cpu(cpu) {
+		struct crypto_comp *tfm;
+
+		ret = zcomp_strm_init(comp, per_cpu_ptr(comp->stream, cpu));
+		if (ret)
+			goto fail;
+
+		tfm = crypto_alloc_comp(compress, 0, 0);
+		if (IS_ERR(tfm)) {
+			ret = PTR_ERR(tfm);
+			goto fail;
+		}
+		*per_cpu_ptr(comp->dtfm, cpu) = tfm;
+	}
+
+	return comp;
+
+fail:
+	zcomp_destroy(comp);
+	return ERR_PTR(ret);
+}
@@ -0,0 +1,55 @@
+/*
+ * Compressed RAM block device - compression streams
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZCOMP_H_
+#define _ZCOMP_H_
+
+#include <linux/mutex.h>
+#include <linux/crypto.h>
+
+/*
+ * A compression stream: a crypto compression transform (which owns the
+ * algorithm's working memory) plus a scratch buffer large enough for
+ * the worst case output of a single page.
+ */
+struct zcomp_strm {
+	struct crypto_comp *tfm;
+	void *buffer;
+	/* a writer migrated off this CPU may still be using the stream */
+	struct mutex lock;
+};
+
+/* one stream per possible CPU, so writers rarely wait for each other */
+struct zcomp {
+	struct zcomp_strm __percpu *stream;
+	/*
+	 * Decompression runs with preemption disabled (under the slot
+	 * lock), so it uses its own per-CPU transform and never waits
+	 * for a writer that holds the compression stream.
+	 */
+	struct crypto_comp * __percpu *dtfm;
+	const char *name;
+};
+
+ssize_t zcomp_available_show(const char *comp, char *buf);
+bool zcomp_available_algorithm(const char *comp);
+
+struct zcomp *zcomp_create(const char *comp);
+void zcomp_destroy(struct zcomp *comp);
+
+struct zcomp_strm *zcomp_strm_find(struct zcomp *comp);
+void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *zstrm);
+
+int zcomp_compress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, size_t *dst_len);
+int zcomp_decompress(struct zcomp *comp, const unsigned char *src,
+		size_t src_len, unsigned char *dst);
+
+#endif /* _ZCOMP_H_ */
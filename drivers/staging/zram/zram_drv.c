@@ -23,17 +23,22 @@
 #include <linux/kernel.h>
 #include <linux/bio.h>
 #include <linux/bitops.h>
+#include <linux/bit_spinlock.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/completion.h>
 #include <linux/device.h>
+#include <linux/err.h>
+#include <linux/fs.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 
 #include "zram_drv.h"
+#include "zram_dedup.h"
 
 /* Globals */
 static int zram_major;
@@ -42,68 +47,110 @@ struct zram *zram_devices;
 /* Module params (documentation at end) */
 static unsigned int num_devices;
 
-static void zram_stat_inc(u32 *v)
+/* Raise the mem_used_max watermark to @pages if it is a new high */
+static void zram_update_used_max(struct zram *zram, unsigned long pages)
 {
-	*v = *v + 1;
+	long old_max, cur_max;
+
+	old_max = atomic_long_read(&zram->stats.max_used_pages);
+	do {
+		cur_max = old_max;
+		if (pages <= cur_max)
+			break;
+		old_max = atomic_long_cmpxchg(&zram->stats.max_used_pages,
+					      cur_max, pages);
+	} while (old_max != cur_max);
 }
 
-static void zram_stat_dec(u32 *v)
+/*
+ * Table entries are protected by a bit spinlock in their value word,
+ * so slots can be read and written concurrently by different CPUs.
+ */
+static void zram_lock_table(struct zram *zram, u32 index)
 {
-	*v = *v - 1;
+	bit_spin_lock(ZRAM_ACCESS, &zram->table[index].value);
 }
 
-static void zram_stat64_add(struct zram *zram, u64 *v, u64 inc)
+static void zram_unlock_table(struct zram *zram, u32 index)
 {
-	spin_lock(&zram->stat64_lock);
-	*v = *v + inc;
-	spin_unlock(&zram->stat64_lock);
+	bit_spin_unlock(ZRAM_ACCESS, &zram->table[index].value);
 }
 
-static void zram_stat64_sub(struct zram *zram, u64 *v, u64 dec)
+static int zram_test_flag(struct zram *zram, u32 index,
+			enum zram_pageflags flag)
 {
-	spin_lock(&zram->stat64_lock);
-	*v = *v - dec;
-	spin_unlock(&zram->stat64_lock);
+	return zram->table[index].value & BIT(flag);
 }
 
-static void zram_stat64_inc(struct zram *zram, u64 *v)
+static void zram_set_flag(struct zram *zram, u32 index,
+			enum zram_pageflags flag)
 {
-	zram_stat64_add(zram, v, 1);
+	zram->table[index].value |= BIT(flag);
 }
 
-static int zram_test_flag(struct zram *zram, u32 index,
+static void zram_clear_flag(struct zram *zram, u32 index,
 			enum zram_pageflags flag)
 {
-	return zram->table[index].flags & BIT(flag);
+	zram->table[index].value &= ~BIT(flag);
 }
 
-static void zram_set_flag(struct zram *zram, u32 index,
-			enum zram_pageflags flag)
+static size_t zram_get_obj_size(struct zram *zram, u32 index)
 {
-	zram->table[index].flags |= BIT(flag);
+	return zram->table[index].value & (BIT(ZRAM_FLAG_SHIFT) - 1);
 }
 
-static void zram_clear_flag(struct zram *zram, u32 index,
-			enum zram_pageflags flag)
+static void zram_set_obj_size(struct zram *zram, u32 index, size_t size)
 {
-	zram->table[index].flags &= ~BIT(flag);
+	unsigned long flags = zram->table[index].value >> ZRAM_FLAG_SHIFT;
+
+	zram->table[index].value = (flags << ZRAM_FLAG_SHIFT) | size;
+}
+
+/* zsmalloc handle of the object stored in a slot, 0 if there is none */
+static unsigned long zram_get_handle(struct zram *zram, u32 index)
+{
+	if (zram_test_flag(zram, index, ZRAM_SAME))
+		return 0;
+
+	if (zram_test_flag(zram, index, ZRAM_DEDUP))
+		return zram->table[index].entry->handle;
+
+	return zram->table[index].handle;
 }
 
-static int page_zero_filled(void *ptr)
+static int page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
 	unsigned long *page;
 
 	page = (unsigned long *)ptr;
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	for (pos = 0; pos < PAGE_SIZE / sizeof(*page) - 1; pos++) {
+		if (page[pos] != page[pos + 1])
 			return 0;
 	}
 
+	*element = page[pos];
+
 	return 1;
 }
 
+static void zram_fill_page(void *ptr, unsigned long len,
+			unsigned long element)
+{
+	unsigned long *page = ptr;
+	unsigned long pos;
+
+	WARN_ON_ONCE(!IS_ALIGNED(len, sizeof(unsigned long)));
+	if (likely(element == 0)) {
+		memset(ptr, 0, len);
+		return;
+	}
+
+	for (pos = 0; pos < len / sizeof(*page); pos++)
+		page[pos] = element;
+}
+
 static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 {
 	if (!zram->disksize) {
@@ -133,46 +180,93 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 	zram->disksize &= PAGE_MASK;
 }
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+/* Returns a free page index on the backing device, 0 if it is full */
+static unsigned long zram_alloc_blk(struct zram *zram)
+{
+	unsigned long blk_idx = 1;
+
+retry:
+	/* skip page 0 so a zero blk_idx is never a valid location */
+	blk_idx = find_next_zero_bit(zram->bitmap, zram->nr_pages, blk_idx);
+	if (blk_idx >= zram->nr_pages)
+		return 0;
+
+	if (test_and_set_bit(blk_idx, zram->bitmap))
+		goto retry;
+
+	atomic_inc(&zram->stats.bd_count);
+	return blk_idx;
+}
+
+static void zram_free_blk(struct zram *zram, unsigned long blk_idx)
+{
+	WARN_ON_ONCE(!test_and_clear_bit(blk_idx, zram->bitmap));
+	atomic_dec(&zram->stats.bd_count);
+}
+#else
+static inline void zram_free_blk(struct zram *zram, unsigned long blk_idx) { }
+#endif
+
+/* Must be called with the slot locked */
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	unsigned long handle = zram->table[index].handle;
-	u16 size = zram->table[index].size;
+	size_t size = zram_get_obj_size(zram, index);
 
-	if (unlikely(!handle)) {
-		/*
-		 * No memory is allocated for zero filled pages.
-		 * Simply clear zero page flag.
-		 */
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			zram_clear_flag(zram, index, ZRAM_ZERO);
-			zram_stat_dec(&zram->stats.pages_zero);
-		}
+	/* Access and writeback state belong to the old content */
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+	zram_clear_flag(zram, index, ZRAM_HUGE);
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		zram_clear_flag(zram, index, ZRAM_WB);
+		zram_free_blk(zram, zram->table[index].blk_idx);
+		zram->table[index].blk_idx = 0;
+		return;
+	}
+
+	/*
+	 * No memory is allocated for same element filled pages.
+	 * Simply clear same page flag.
+	 */
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_clear_flag(zram, index, ZRAM_SAME);
+		zram->table[index].element = 0;
+		atomic_dec(&zram->stats.pages_same);
 		return;
 	}
 
+	if (unlikely(!handle))
+		return;
+
 	if (unlikely(size > max_zpage_size))
-		zram_stat_dec(&zram->stats.bad_compress);
+		atomic_dec(&zram->stats.bad_compress);
 
-	zs_free(zram->mem_pool, handle);
+	if (zram_test_flag(zram, index, ZRAM_DEDUP)) {
+		zram_dedup_put(zram, zram->table[index].entry);
+		zram_clear_flag(zram, index, ZRAM_DEDUP);
+	} else {
+		zs_free(zram->mem_pool, handle);
+		atomic64_sub(size, &zram->stats.compr_size);
+	}
 
 	if (size <= PAGE_SIZE / 2)
-		zram_stat_dec(&zram->stats.good_compress);
+		atomic_dec(&zram->stats.good_compress);
 
-	zram_stat64_sub(zram, &zram->stats.compr_size,
-			zram->table[index].size);
-	zram_stat_dec(&zram->stats.pages_stored);
+	atomic_dec(&zram->stats.pages_stored);
 
 	zram->table[index].handle = 0;
-	zram->table[index].size = 0;
+	zram_set_obj_size(zram, index, 0);
 }
 
-static void handle_zero_page(struct bio_vec *bvec)
+static void handle_same_page(struct bio_vec *bvec, unsigned long element)
 {
 	struct page *page = bvec->bv_page;
 	void *user_mem;
 
 	user_mem = kmap_atomic(page);
-	memset(user_mem + bvec->bv_offset, 0, bvec->bv_len);
+	zram_fill_page(user_mem + bvec->bv_offset, bvec->bv_len, element);
 	kunmap_atomic(user_mem);
 
 	flush_dcache_page(page);
@@ -183,98 +277,454 @@ static inline int is_partial_io(struct bio_vec *bvec)
 	return bvec->bv_len != PAGE_SIZE;
 }
 
-static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
-			  u32 index, int offset, struct bio *bio)
+static int zram_decompress_page(struct zram *zram, unsigned char *mem,
+				u32 index)
 {
-	int ret;
-	size_t clen;
-	struct page *page;
-	unsigned char *user_mem, *cmem, *uncmem = NULL;
+	int ret = 0;
+	unsigned char *cmem;
+	unsigned long handle;
+	size_t size;
 
-	page = bvec->bv_page;
+	zram_lock_table(zram, index);
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		unsigned long element = zram->table[index].element;
 
-	if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-		handle_zero_page(bvec);
+		zram_unlock_table(zram, index);
+		zram_fill_page(mem, PAGE_SIZE, element);
 		return 0;
 	}
 
-	/* Requested page is not present in compressed area */
-	if (unlikely(!zram->table[index].handle)) {
-		pr_debug("Read before write: sector=%lu, size=%u",
-			 (ulong)(bio->bi_sector), bio->bi_size);
-		handle_zero_page(bvec);
+	/* Sleeping I/O is needed, see zram_read_page() */
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		zram_unlock_table(zram, index);
+		return -EAGAIN;
+	}
+
+	handle = zram_get_handle(zram, index);
+	size = zram_get_obj_size(zram, index);
+
+	if (!handle) {
+		zram_unlock_table(zram, index);
+		memset(mem, 0, PAGE_SIZE);
 		return 0;
 	}
 
-	if (is_partial_io(bvec)) {
-		/* Use  a temporary buffer to decompress the page */
-		uncmem = kmalloc(PAGE_SIZE, GFP_KERNEL);
-		if (!uncmem) {
-			pr_info("Error allocating temp memory!\n");
-			return -ENOMEM;
-		}
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
+	if (size == PAGE_SIZE)
+		memcpy(mem, cmem, PAGE_SIZE);
+	else
+		ret = zcomp_decompress(zram->comp, cmem, size, mem);
+	zs_unmap_object(zram->mem_pool, handle);
+	zram_unlock_table(zram, index);
+
+	/* Should NEVER happen. Return bio error if it does. */
+	if (unlikely(ret)) {
+		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
+		atomic64_inc(&zram->stats.failed_reads);
+		return ret;
 	}
 
-	user_mem = kmap_atomic(page);
-	if (!is_partial_io(bvec))
-		uncmem = user_mem;
-	clen = PAGE_SIZE;
+	return 0;
+}
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+struct zram_bdev_io {
+	struct work_struct work;
+	struct completion done;
+	struct zram *zram;
+	struct page *page;
+	unsigned long blk_idx;
+	int rw;
+	int error;
+};
+
+static void zram_bdev_end_io(struct bio *bio, int err)
+{
+	struct zram_bdev_io *io = bio->bi_private;
+
+	if (!err && !test_bit(BIO_UPTODATE, &bio->bi_flags))
+		err = -EIO;
+	io->error = err;
+	complete(&io->done);
+}
 
-	cmem = zs_map_object(zram->mem_pool, zram->table[index].handle,
-				ZS_MM_RO);
+static void zram_bdev_submit(struct zram_bdev_io *io)
+{
+	struct bio *bio;
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio) {
+		io->error = -ENOMEM;
+		return;
+	}
+
+	bio->bi_sector = io->blk_idx * SECTORS_PER_PAGE;
+	bio->bi_bdev = io->zram->bdev;
+	bio->bi_end_io = zram_bdev_end_io;
+	bio->bi_private = io;
+	if (!bio_add_page(bio, io->page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		io->error = -EIO;
+		return;
+	}
 
-	if (zram->table[index].size == PAGE_SIZE) {
-		memcpy(uncmem, cmem, PAGE_SIZE);
-		ret = LZO_E_OK;
+	init_completion(&io->done);
+	submit_bio(io->rw | REQ_SYNC, bio);
+	wait_for_completion(&io->done);
+	bio_put(bio);
+}
+
+static void zram_bdev_work(struct work_struct *work)
+{
+	zram_bdev_submit(container_of(work, struct zram_bdev_io, work));
+}
+
+/*
+ * Synchronous page I/O on the backing device. Bios submitted from within
+ * a make_request function are only dispatched after it returns (see
+ * current->bio_list), so I/O issued from our own request path is handed
+ * to a worker instead of waiting on itself.
+ */
+static int zram_bdev_rw(struct zram *zram, struct page *page,
+			unsigned long blk_idx, int rw)
+{
+	struct zram_bdev_io io = {
+		.zram = zram,
+		.page = page,
+		.blk_idx = blk_idx,
+		.rw = rw,
+	};
+
+	if (current->bio_list) {
+		INIT_WORK_ONSTACK(&io.work, zram_bdev_work);
+		queue_work(system_unbound_wq, &io.work);
+		flush_work(&io.work);
+		destroy_work_on_stack(&io.work);
 	} else {
-		ret = lzo1x_decompress_safe(cmem, zram->table[index].size,
-				    uncmem, &clen);
+		zram_bdev_submit(&io);
 	}
 
-	if (is_partial_io(bvec)) {
-		memcpy(user_mem + bvec->bv_offset, uncmem + offset,
-		       bvec->bv_len);
-		kfree(uncmem);
+	if (!io.error)
+		atomic64_inc(rw == READ ? &zram->stats.bd_reads :
+				      &zram->stats.bd_writes);
+	return io.error;
+}
+
+/*
+ * Read a written back slot into @mem. Returns -EAGAIN if the slot is not
+ * (or no longer) on the backing device.
+ */
+static int zram_read_from_bdev(struct zram *zram, unsigned char *mem,
+			u32 index)
+{
+	int ret;
+	void *src;
+	struct page *page;
+	unsigned long blk_idx;
+
+	zram_lock_table(zram, index);
+	if (!zram_test_flag(zram, index, ZRAM_WB)) {
+		zram_unlock_table(zram, index);
+		return -EAGAIN;
+	}
+	blk_idx = zram->table[index].blk_idx;
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+	zram_unlock_table(zram, index);
+
+	page = alloc_page(GFP_NOIO);
+	if (!page)
+		return -ENOMEM;
+
+	ret = zram_bdev_rw(zram, page, blk_idx, READ);
+	if (ret) {
+		pr_err("Backing device read failed! err=%d, page=%u\n",
+			ret, index);
+		atomic64_inc(&zram->stats.failed_reads);
+		goto out;
 	}
 
-	zs_unmap_object(zram->mem_pool, zram->table[index].handle);
-	kunmap_atomic(user_mem);
+	/* The slot may have been rewritten while we slept */
+	zram_lock_table(zram, index);
+	if (!zram_test_flag(zram, index, ZRAM_WB) ||
+	    zram->table[index].blk_idx != blk_idx)
+		ret = -EAGAIN;
+	zram_unlock_table(zram, index);
+
+	if (!ret) {
+		src = kmap_atomic(page);
+		memcpy(mem, src, PAGE_SIZE);
+		kunmap_atomic(src);
+	}
+out:
+	__free_page(page);
+	return ret;
+}
 
-	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != LZO_E_OK)) {
-		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
-		zram_stat64_inc(zram, &zram->stats.failed_reads);
-		return ret;
+void zram_reset_bdev(struct zram *zram)
+{
+	if (!zram->bdev)
+		return;
+
+	blkdev_put(zram->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	filp_close(zram->backing_dev, NULL);
+	vfree(zram->bitmap);
+
+	zram->backing_dev = NULL;
+	zram->bdev = NULL;
+	zram->nr_pages = 0;
+	zram->bitmap = NULL;
+}
+
+/* Must be called with init_lock held for write on an uninitialized device */
+int zram_set_backing_dev(struct zram *zram, const char *file_name)
+{
+	int err;
+	unsigned long nr_pages, *bitmap;
+	struct file *backing_dev;
+	struct block_device *bdev;
+	struct inode *inode;
+
+	backing_dev = filp_open(file_name, O_RDWR | O_LARGEFILE, 0);
+	if (IS_ERR(backing_dev))
+		return PTR_ERR(backing_dev);
+
+	inode = backing_dev->f_mapping->host;
+
+	/* Only block devices (use a loop device for a file) */
+	if (!S_ISBLK(inode->i_mode)) {
+		err = -ENOTBLK;
+		goto out;
 	}
 
-	flush_dcache_page(page);
+	bdev = bdgrab(I_BDEV(inode));
+	err = blkdev_get(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL, zram);
+	if (err < 0)
+		goto out;
+
+	nr_pages = i_size_read(inode) >> PAGE_SHIFT;
+	if (nr_pages < 2) {
+		err = -EINVAL;
+		goto out_put;
+	}
+
+	bitmap = vzalloc(BITS_TO_LONGS(nr_pages) * sizeof(long));
+	if (!bitmap) {
+		err = -ENOMEM;
+		goto out_put;
+	}
+
+	zram_reset_bdev(zram);
+
+	zram->backing_dev = backing_dev;
+	zram->bdev = bdev;
+	zram->nr_pages = nr_pages;
+	zram->bitmap = bitmap;
+	pr_info("setup backing device %s\n", file_name);
 
 	return 0;
+
+out_put:
+	blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+out:
+	filp_close(backing_dev, NULL);
+	return err;
+}
+
+/* Mark every slot holding a compressed object as idle */
+void zram_mark_idle(struct zram *zram)
+{
+	size_t index;
+
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		zram_lock_table(zram, index);
+		if (zram->table[index].handle &&
+		    !zram_test_flag(zram, index, ZRAM_SAME) &&
+		    !zram_test_flag(zram, index, ZRAM_WB))
+			zram_set_flag(zram, index, ZRAM_IDLE);
+		zram_unlock_table(zram, index);
+		cond_resched();
+	}
 }
 
-static int zram_read_before_write(struct zram *zram, char *mem, u32 index)
+static bool zram_wb_candidate(struct zram *zram, u32 index,
+			enum zram_wb_mode mode)
+{
+	if (!zram->table[index].handle ||
+	    zram_test_flag(zram, index, ZRAM_SAME) ||
+	    zram_test_flag(zram, index, ZRAM_WB) ||
+	    zram_test_flag(zram, index, ZRAM_UNDER_WB))
+		return false;
+
+	if (mode == ZRAM_WB_HUGE)
+		return zram_test_flag(zram, index, ZRAM_HUGE);
+
+	return zram_test_flag(zram, index, ZRAM_IDLE);
+}
+
+/*
+ * Move huge or idle pages to the backing device. Must be called with
+ * wb_lock held and init_lock held for read on an initialized device.
+ */
+int zram_writeback(struct zram *zram, enum zram_wb_mode mode)
+{
+	int ret = 0, err;
+	size_t index;
+	unsigned long blk_idx;
+	struct page *page;
+	void *mem;
+
+	if (!zram->bdev)
+		return -ENODEV;
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page)
+		return -ENOMEM;
+
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		zram_lock_table(zram, index);
+		if (!zram_wb_candidate(zram, index, mode)) {
+			zram_unlock_table(zram, index);
+			continue;
+		}
+		/* Cleared by zram_free_page() if the slot changes under us */
+		zram_set_flag(zram, index, ZRAM_UNDER_WB);
+		zram_unlock_table(zram, index);
+
+		mem = kmap(page);
+		err = zram_decompress_page(zram, mem, index);
+		kunmap(page);
+
+		blk_idx = err ? 0 : zram_alloc_blk(zram);
+		if (!blk_idx) {
+			zram_lock_table(zram, index);
+			zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+			zram_unlock_table(zram, index);
+			if (err)
+				continue;
+			ret = -ENOSPC;
+			break;
+		}
+
+		err = zram_bdev_rw(zram, page, blk_idx, WRITE);
+
+		zram_lock_table(zram, index);
+		if (err || !zram_test_flag(zram, index, ZRAM_UNDER_WB)) {
+			zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+			zram_unlock_table(zram, index);
+			zram_free_blk(zram, blk_idx);
+			if (!err)
+				continue;
+			ret = err;
+			break;
+		}
+
+		zram_free_page(zram, index);
+		zram_set_flag(zram, index, ZRAM_WB);
+		zram->table[index].blk_idx = blk_idx;
+		zram_unlock_table(zram, index);
+	}
+
+	__free_page(page);
+	return ret;
+}
+#else
+static int zram_read_from_bdev(struct zram *zram, unsigned char *mem,
+			u32 index)
+{
+	return -EIO;
+}
+#endif
+
+/*
+ * Read the content of a slot into @mem, fetching it from the backing
+ * device if it has been written back. May sleep.
+ */
+static int zram_read_page(struct zram *zram, unsigned char *mem, u32 index)
 {
 	int ret;
-	size_t clen = PAGE_SIZE;
-	unsigned char *cmem;
-	unsigned long handle = zram->table[index].handle;
 
-	if (zram_test_flag(zram, index, ZRAM_ZERO) || !handle) {
-		memset(mem, 0, PAGE_SIZE);
+	do {
+		ret = zram_decompress_page(zram, mem, index);
+		if (ret == -EAGAIN)
+			ret = zram_read_from_bdev(zram, mem, index);
+	} while (ret == -EAGAIN);
+
+	return ret;
+}
+
+/* Read through a bounce buffer, for partial I/O and written back pages */
+static int zram_bvec_read_buffered(struct zram *zram, struct bio_vec *bvec,
+			u32 index, int offset)
+{
+	int ret;
+	unsigned char *user_mem, *uncmem;
+
+	uncmem = kmalloc(PAGE_SIZE, GFP_NOIO);
+	if (!uncmem) {
+		pr_info("Error allocating temp memory!\n");
+		return -ENOMEM;
+	}
+
+	ret = zram_read_page(zram, uncmem, index);
+	if (!ret) {
+		user_mem = kmap_atomic(bvec->bv_page);
+		memcpy(user_mem + bvec->bv_offset, uncmem + offset,
+		       bvec->bv_len);
+		kunmap_atomic(user_mem);
+		flush_dcache_page(bvec->bv_page);
+	}
+
+	kfree(uncmem);
+	return ret;
+}
+
+static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
+			  u32 index, int offset, struct bio *bio)
+{
+	int ret;
+	bool wb;
+	struct page *page;
+	unsigned char *user_mem;
+
+	page = bvec->bv_page;
+
+	zram_lock_table(zram, index);
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		unsigned long element = zram->table[index].element;
+
+		zram_unlock_table(zram, index);
+		handle_same_page(bvec, element);
 		return 0;
 	}
 
-	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
-	ret = lzo1x_decompress_safe(cmem, zram->table[index].size,
-				    mem, &clen);
-	zs_unmap_object(zram->mem_pool, handle);
+	/* Requested page is not present in compressed area */
+	if (unlikely(!zram->table[index].handle)) {
+		zram_unlock_table(zram, index);
+		pr_debug("Read before write: sector=%lu, size=%u",
+			 (ulong)(bio->bi_sector), bio->bi_size);
+		handle_same_page(bvec, 0);
+		return 0;
+	}
 
-	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != LZO_E_OK)) {
-		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
-		zram_stat64_inc(zram, &zram->stats.failed_reads);
+	wb = zram_test_flag(zram, index, ZRAM_WB);
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+	zram_unlock_table(zram, index);
+
+	if (is_partial_io(bvec) || wb)
+		return zram_bvec_read_buffered(zram, bvec, index, offset);
+
+	user_mem = kmap_atomic(page);
+	ret = zram_decompress_page(zram, user_mem, index);
+	kunmap_atomic(user_mem);
+
+	/* Written back since we looked at the slot */
+	if (unlikely(ret == -EAGAIN))
+		return zram_bvec_read_buffered(zram, bvec, index, offset);
+
+	if (unlikely(ret))
 		return ret;
-	}
+
+	flush_dcache_page(page);
 
 	return 0;
 }
@@ -282,41 +732,36 @@ static int zram_read_before_write(struct zram *zram, char *mem, u32 index)
 static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			   int offset)
 {
-	int ret;
+	int ret = 0;
 	size_t clen;
-	unsigned long handle;
+	unsigned long handle = 0;
+	unsigned long element;
+	unsigned long alloced_pages;
+	u32 checksum = 0;
 	struct page *page;
 	unsigned char *user_mem, *cmem, *src, *uncmem = NULL;
+	struct zcomp_strm *zstrm = NULL;
+	struct zram_entry *entry = NULL;
 
 	page = bvec->bv_page;
-	src = zram->compress_buffer;
 
 	if (is_partial_io(bvec)) {
 		/*
 		 * This is a partial IO. We need to read the full page
 		 * before to write the changes.
 		 */
-		uncmem = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		uncmem = kmalloc(PAGE_SIZE, GFP_NOIO);
 		if (!uncmem) {
 			pr_info("Error allocating temp memory!\n");
 			ret = -ENOMEM;
 			goto out;
 		}
-		ret = zram_read_before_write(zram, uncmem, index);
-		if (ret) {
-			kfree(uncmem);
+		ret = zram_read_page(zram, uncmem, index);
+		if (ret)
 			goto out;
-		}
 	}
 
-	/*
-	 * System overwrites unused sectors. Free memory associated
-	 * with this sector now.
-	 */
-	if (zram->table[index].handle ||
-	    zram_test_flag(zram, index, ZRAM_ZERO))
-		zram_free_page(zram, index);
-
+	zstrm = zcomp_strm_find(zram->comp);
 	user_mem = kmap_atomic(page);
 
 	if (is_partial_io(bvec))
@@ -325,32 +770,47 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 	else
 		uncmem = user_mem;
 
-	if (page_zero_filled(uncmem)) {
+	if (page_same_filled(uncmem, &element)) {
 		kunmap_atomic(user_mem);
-		if (is_partial_io(bvec))
-			kfree(uncmem);
-		zram_stat_inc(&zram->stats.pages_zero);
-		zram_set_flag(zram, index, ZRAM_ZERO);
-		ret = 0;
+		/*
+		 * System overwrites unused sectors. Free memory associated
+		 * with this sector now.
+		 */
+		zram_lock_table(zram, index);
+		zram_free_page(zram, index);
+		zram_set_flag(zram, index, ZRAM_SAME);
+		zram->table[index].element = element;
+		zram_unlock_table(zram, index);
+		atomic_inc(&zram->stats.pages_same);
 		goto out;
 	}
 
-	ret = lzo1x_1_compress(uncmem, PAGE_SIZE, src, &clen,
-			       zram->compress_workmem);
+	if (zram_dedup_enabled(zram)) {
+		checksum = zram_dedup_checksum(uncmem);
+		entry = zram_dedup_find(zram, zstrm, uncmem, checksum);
+		if (entry) {
+			/* Same content already stored, skip compression */
+			kunmap_atomic(user_mem);
+			clen = entry->len;
+			goto found_dup;
+		}
+	}
+
+	ret = zcomp_compress(zram->comp, zstrm, uncmem, &clen);
 
 	kunmap_atomic(user_mem);
-	if (is_partial_io(bvec))
-			kfree(uncmem);
+	if (!is_partial_io(bvec))
+		uncmem = NULL;
 
-	if (unlikely(ret != LZO_E_OK)) {
+	if (unlikely(ret)) {
 		pr_err("Compression failed! err=%d\n", ret);
 		goto out;
 	}
 
+	src = zstrm->buffer;
 	if (unlikely(clen > max_zpage_size)) {
-		zram_stat_inc(&zram->stats.bad_compress);
-		src = uncmem;
 		clen = PAGE_SIZE;
+		src = uncmem;
 	}
 
 	handle = zs_malloc(zram->mem_pool, clen);
@@ -360,26 +820,74 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 		ret = -ENOMEM;
 		goto out;
 	}
+
+	alloced_pages = zs_get_total_pages(zram->mem_pool);
+	if (zram->limit_pages && alloced_pages > zram->limit_pages) {
+		zs_free(zram->mem_pool, handle);
+		ret = -ENOMEM;
+		goto out;
+	}
+	zram_update_used_max(zram, alloced_pages);
+
 	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_WO);
 
-	memcpy(cmem, src, clen);
+	if (!src) {
+		/* Incompressible full page: copy it straight from the bio */
+		src = kmap_atomic(page);
+		memcpy(cmem, src, PAGE_SIZE);
+		kunmap_atomic(src);
+	} else {
+		memcpy(cmem, src, clen);
+	}
 
 	zs_unmap_object(zram->mem_pool, handle);
 
-	zram->table[index].handle = handle;
-	zram->table[index].size = clen;
+	if (zram_dedup_enabled(zram)) {
+		entry = zram_dedup_insert(zram, handle, clen, checksum);
+		if (!entry) {
+			zs_free(zram->mem_pool, handle);
+			ret = -ENOMEM;
+			goto out;
+		}
+	} else {
+		atomic64_add(clen, &zram->stats.compr_size);
+	}
+
+found_dup:
+	zcomp_strm_release(zram->comp, zstrm);
+	zstrm = NULL;
+
+	/*
+	 * Free memory associated with this sector now, the slot lock
+	 * orders us against concurrent readers of the old object.
+	 */
+	zram_lock_table(zram, index);
+	zram_free_page(zram, index);
+	if (entry) {
+		zram->table[index].entry = entry;
+		zram_set_flag(zram, index, ZRAM_DEDUP);
+	} else {
+		zram->table[index].handle = handle;
+	}
+	zram_set_obj_size(zram, index, clen);
+	if (clen == PAGE_SIZE)
+		zram_set_flag(zram, index, ZRAM_HUGE);
+	zram_unlock_table(zram, index);
 
 	/* Update stats */
-	zram_stat64_add(zram, &zram->stats.compr_size, clen);
-	zram_stat_inc(&zram->stats.pages_stored);
+	atomic_inc(&zram->stats.pages_stored);
+	if (unlikely(clen > max_zpage_size))
+		atomic_inc(&zram->stats.bad_compress);
 	if (clen <= PAGE_SIZE / 2)
-		zram_stat_inc(&zram->stats.good_compress);
-
-	return 0;
+		atomic_inc(&zram->stats.good_compress);
 
 out:
+	if (zstrm)
+		zcomp_strm_release(zram->comp, zstrm);
+	if (is_partial_io(bvec))
+		kfree(uncmem);
 	if (ret)
-		zram_stat64_inc(zram, &zram->stats.failed_writes);
+		atomic64_inc(&zram->stats.failed_writes);
 	return ret;
 }
 
@@ -388,15 +896,10 @@ static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
 {
 	int ret;
 
-	if (rw == READ) {
-		down_read(&zram->lock);
+	if (rw == READ)
 		ret = zram_bvec_read(zram, bvec, index, offset, bio);
-		up_read(&zram->lock);
-	} else {
-		down_write(&zram->lock);
+	else
 		ret = zram_bvec_write(zram, bvec, index, offset);
-		up_write(&zram->lock);
-	}
 
 	return ret;
 }
@@ -416,10 +919,10 @@ static void __zram_make_request(struct zram *zram, struct bio *bio, int rw)
 
 	switch (rw) {
 	case READ:
-		zram_stat64_inc(zram, &zram->stats.num_reads);
+		atomic64_inc(&zram->stats.num_reads);
 		break;
 	case WRITE:
-		zram_stat64_inc(zram, &zram->stats.num_writes);
+		atomic64_inc(&zram->stats.num_writes);
 		break;
 	}
 
@@ -495,7 +998,7 @@ static int zram_make_request(struct request_queue *queue, struct bio *bio)
 		goto error_unlock;
 
 	if (!valid_io_request(zram, bio)) {
-		zram_stat64_inc(zram, &zram->stats.invalid_io);
+		atomic64_inc(&zram->stats.invalid_io);
 		goto error_unlock;
 	}
 
@@ -518,23 +1021,17 @@ void __zram_reset_device(struct zram *zram)
 	zram->init_done = 0;
 
 	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
-
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	if (zram->comp)
+		zcomp_destroy(zram->comp);
+	zram->comp = NULL;
 
 	/* Free all pages that are still in this zram device */
-	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		unsigned long handle = zram->table[index].handle;
-		if (!handle)
-			continue;
-
-		zs_free(zram->mem_pool, handle);
-	}
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++)
+		zram_free_page(zram, index);
 
 	vfree(zram->table);
 	zram->table = NULL;
+	zram_dedup_fini(zram);
 
 	zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
@@ -543,6 +1040,7 @@ void __zram_reset_device(struct zram *zram)
 	memset(&zram->stats, 0, sizeof(zram->stats));
 
 	zram->disksize = 0;
+	zram->limit_pages = 0;
 }
 
 void zram_reset_device(struct zram *zram)
@@ -566,18 +1064,12 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail_no_table;
-	}
-
-	zram->compress_buffer =
-		(void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
+	zram->comp = zcomp_create(zram->compressor);
+	if (IS_ERR(zram->comp)) {
+		pr_err("Error allocating %s compression streams!\n",
+			zram->compressor);
+		ret = PTR_ERR(zram->comp);
+		zram->comp = NULL;
 		goto fail_no_table;
 	}
 
@@ -594,13 +1086,18 @@ int zram_init_device(struct zram *zram)
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = zs_create_pool("zram", GFP_NOIO | __GFP_HIGHMEM);
+	zram->mem_pool = zs_create_pool(zram->disk->disk_name,
+					GFP_NOIO | __GFP_HIGHMEM);
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
 		goto fail;
 	}
 
+	ret = zram_dedup_init(zram, num_pages);
+	if (ret)
+		goto fail;
+
 	zram->init_done = 1;
 	up_write(&zram->init_lock);
 
@@ -623,8 +1120,10 @@ static void zram_slot_free_notify(struct block_device *bdev,
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	zram_lock_table(zram, index);
 	zram_free_page(zram, index);
-	zram_stat64_inc(zram, &zram->stats.notify_free);
+	zram_unlock_table(zram, index);
+	atomic64_inc(&zram->stats.notify_free);
 }
 
 static const struct block_device_operations zram_devops = {
@@ -636,9 +1135,11 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = 0;
 
-	init_rwsem(&zram->lock);
 	init_rwsem(&zram->init_lock);
-	spin_lock_init(&zram->stat64_lock);
+#ifdef CONFIG_ZRAM_WRITEBACK
+	mutex_init(&zram->wb_lock);
+#endif
+	strlcpy(zram->compressor, default_compressor, sizeof(zram->compressor));
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -775,6 +1276,7 @@ static void __exit zram_exit(void)
 		destroy_device(zram);
 		if (zram->init_done)
 			zram_reset_device(zram);
+		zram_reset_bdev(zram);
 	}
 
 	unregister_blkdev(zram_major, "zram");
@@ -19,6 +19,7 @@
 #include <linux/mutex.h>
 
 #include "../zsmalloc/zsmalloc.h"
+#include "zcomp.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -31,6 +32,9 @@ static const unsigned max_num_devices = 32;
 /* Default zram disk size: 25% of total RAM */
 static const unsigned default_disksize_perc_ram = 25;
 
+/* Default compression algorithm, see comp_algorithm sysfs node */
+static const char default_compressor[] = "lzo";
+
 /*
  * Pages that compress to size greater than this are stored
  * uncompressed in memory.
@@ -54,46 +58,70 @@ static const size_t max_zpage_size = PAGE_SIZE / 4 * 3;
 #define ZRAM_SECTOR_PER_LOGICAL_BLOCK	\
 	(1 << (ZRAM_LOGICAL_BLOCK_SHIFT - SECTOR_SHIFT))
 
-/* Flags for zram pages (table[page_no].flags) */
+/*
+ * The lower ZRAM_FLAG_SHIFT bits of table.value hold the object size
+ * (excluding header), the higher bits hold zram_pageflags.
+ */
+#define ZRAM_FLAG_SHIFT		(PAGE_SHIFT + 1)
+
+/* Flags for zram pages (table[page_no].value) */
 enum zram_pageflags {
-	/* Page consists entirely of zeros */
-	ZRAM_ZERO,
+	/* Page is filled with one repeating word, kept in table.element */
+	ZRAM_SAME = ZRAM_FLAG_SHIFT,
+	/* Slot is locked (bit spinlock protecting the table entry) */
+	ZRAM_ACCESS,
+	/* table.entry points to a shared, refcounted zram_entry */
+	ZRAM_DEDUP,
+	/* Page is stored on the backing device at table.blk_idx */
+	ZRAM_WB,
+	/* Page is being written back, cleared if the slot changes meanwhile */
+	ZRAM_UNDER_WB,
+	/* Page is incompressible and stored at full PAGE_SIZE */
+	ZRAM_HUGE,
+	/* Page has not been accessed since the last idle marking */
+	ZRAM_IDLE,
 
 	__NR_ZRAM_PAGEFLAGS,
 };
 
 /*-- Data structures */
 
+struct zram_entry;
+
 /* Allocated for each disk page */
 struct table {
-	unsigned long handle;
-	u16 size;	/* object size (excluding header) */
-	u8 count;	/* object ref count (not yet used) */
-	u8 flags;
-} __aligned(4);
+	union {
+		unsigned long handle;		/* zsmalloc handle */
+		struct zram_entry *entry;	/* ZRAM_DEDUP */
+		unsigned long element;		/* ZRAM_SAME */
+		unsigned long blk_idx;		/* ZRAM_WB */
+	};
+	unsigned long value;	/* object size and zram_pageflags */
+};
 
 struct zram_stats {
-	u64 compr_size;		/* compressed size of pages stored */
-	u64 num_reads;		/* failed + successful */
-	u64 num_writes;		/* --do-- */
-	u64 failed_reads;	/* should NEVER! happen */
-	u64 failed_writes;	/* can happen when memory is too low */
-	u64 invalid_io;		/* non-page-aligned I/O requests */
-	u64 notify_free;	/* no. of swap slot free notifications */
-	u32 pages_zero;		/* no. of zero filled pages */
-	u32 pages_stored;	/* no. of pages currently stored */
-	u32 good_compress;	/* % of pages with compression ratio<=50% */
-	u32 bad_compress;	/* % of pages with compression ratio>=75% */
+	atomic64_t compr_size;		/* compressed size of pages stored */
+	atomic64_t num_reads;		/* failed + successful */
+	atomic64_t num_writes;		/* --do-- */
+	atomic64_t failed_reads;	/* should NEVER! happen */
+	atomic64_t failed_writes;	/* can happen when memory is too low */
+	atomic64_t invalid_io;		/* non-page-aligned I/O requests */
+	atomic64_t notify_free;		/* no. of swap slot free notifications */
+	atomic64_t dup_data_size;	/* compressed bytes shared by dedup */
+	atomic64_t bd_reads;		/* no. of reads from backing device */
+	atomic64_t bd_writes;		/* no. of writes to backing device */
+	atomic_long_t max_used_pages;	/* no. of maximum pages stored */
+	atomic_t bd_count;	/* no. of pages on backing device */
+	atomic_t pages_same;	/* no. of same element filled pages */
+	atomic_t pages_stored;	/* no. of pages currently stored */
+	atomic_t good_compress;	/* % of pages with compression ratio<=50% */
+	atomic_t bad_compress;	/* % of pages with compression ratio>=75% */
 };
 
 struct zram {
 	struct zs_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
-	struct table *table;
-	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct rw_semaphore lock; /* protect compression buffers and table
-				   * against concurrent read and writes */
+	struct zcomp *comp;	/* per-CPU compression streams */
+	struct table *table;	/* entries locked with ZRAM_ACCESS */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -104,6 +132,28 @@ struct zram {
 	 * we can store in a disk.
 	 */
 	u64 disksize;	/* bytes */
+	/*
+	 * Upper bound on the pages zs_pool may use, 0 means no limit.
+	 * Writes that would grow the pool past it fail with -ENOMEM.
+	 */
+	unsigned long limit_pages;
+	/* crypto API name of the algorithm used by zcomp */
+	char compressor[CRYPTO_MAX_ALG_NAME];
+#ifdef CONFIG_ZRAM_DEDUP
+	/* content hash index of stored objects, see zram_dedup.c */
+	bool use_dedup;
+	struct zram_hash *hash;
+	size_t hash_size;
+#endif
+#ifdef CONFIG_ZRAM_WRITEBACK
+	/* optional block device incompressible and idle pages go to */
+	struct file *backing_dev;
+	struct block_device *bdev;
+	unsigned long nr_pages;	/* size of bdev in pages */
+	unsigned long *bitmap;	/* used pages on bdev, page 0 is reserved */
+	/* one writeback pass at a time, ZRAM_UNDER_WB is not per pass */
+	struct mutex wb_lock;
+#endif
 
 	struct zram_stats stats;
 };
@@ -117,4 +167,18 @@ extern struct attribute_group zram_disk_attr_group;
 extern int zram_init_device(struct zram *zram);
 extern void __zram_reset_device(struct zram *zram);
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+enum zram_wb_mode {
+	ZRAM_WB_HUGE,	/* incompressible pages */
+	ZRAM_WB_IDLE,	/* pages idle since the last zram_mark_idle() */
+};
+
+extern int zram_set_backing_dev(struct zram *zram, const char *file_name);
+extern void zram_reset_bdev(struct zram *zram);
+extern void zram_mark_idle(struct zram *zram);
+extern int zram_writeback(struct zram *zram, enum zram_wb_mode mode);
+#else
+static inline void zram_reset_bdev(struct zram *zram) { }
+#endif
+
 #endif
@@ -16,6 +16,7 @@
 #include <linux/kernel.h>
 #include <linux/spinlock.h>
 #include <linux/types.h>
+#include <linux/mm.h>
 
 /*
  * This must be power of 2 and greater than of equal to sizeof(link_free).
@@ -34,13 +35,23 @@
 
 /*
  * Object location (<PFN>, <obj_idx>) is encoded as
- * as single (void *) handle value.
+ * a single unsigned long value, the "obj".
  *
  * Note that object index <obj_idx> is relative to system
  * page <PFN> it is stored in, so for each sub-page belonging
  * to a zspage, obj_idx starts with 0.
  *
  * This is made more complicated by various memory models and PAE.
+ *
+ * Callers never see an obj. zs_malloc() hands out a handle, the address
+ * of a slab allocated word holding the current obj, so that compaction
+ * can move objects without the caller noticing. Bit 0 of that word is
+ * a lock (HANDLE_PIN_BIT) held while the object is mapped or migrated.
+ *
+ * The first word of every allocated object holds its handle with
+ * OBJ_ALLOCATED_TAG set, which lets compaction walk a zspage and tell
+ * live objects from free ones (whose first word is a freelist link,
+ * an obj, which always has the tag bit clear).
  */
 
 #ifndef MAX_PHYSMEM_BITS
@@ -55,9 +66,15 @@
 #endif
 #endif
 #define _PFN_BITS		(MAX_PHYSMEM_BITS - PAGE_SHIFT)
-#define OBJ_INDEX_BITS	(BITS_PER_LONG - _PFN_BITS)
+#define OBJ_TAG_BITS		1
+#define OBJ_ALLOCATED_TAG	1
+#define HANDLE_PIN_BIT		0
+#define OBJ_INDEX_BITS	(BITS_PER_LONG - _PFN_BITS - OBJ_TAG_BITS)
 #define OBJ_INDEX_MASK	((_AC(1, UL) << OBJ_INDEX_BITS) - 1)
 
+/* Room kept at the start of each object for its handle */
+#define ZS_HANDLE_SIZE		(sizeof(unsigned long))
+
 #define MAX(a, b) ((a) >= (b) ? (a) : (b))
 /* ZS_MIN_ALLOC_SIZE must be multiple of ZS_ALIGN */
 #define ZS_MIN_ALLOC_SIZE \
@@ -110,11 +127,23 @@ enum fullness_group {
 static const int fullness_threshold_frac = 4;
 
 struct mapping_area {
+#ifdef CONFIG_ZSMALLOC_PGTABLE_MAPPING
+	struct vm_struct *vm; /* vm area for mapping objects that span pages */
+#else
 	char *vm_buf; /* copy buffer for objects that span pages */
+#endif
 	char *vm_addr; /* address of kmap_atomic()'ed pages */
 	enum zs_mapmode vm_mm; /* mapping mode */
 };
 
+enum zs_stat_type {
+	CLASS_ALMOST_FULL,
+	CLASS_ALMOST_EMPTY,
+	OBJ_ALLOCATED,
+	OBJ_USED,
+	NR_ZS_STAT_TYPE,
+};
+
 struct size_class {
 	/*
 	 * Size of objects stored in this class. Must be multiple
@@ -126,10 +155,17 @@ struct size_class {
 	/* Number of PAGE_SIZE sized pages to combine to form a 'zspage' */
 	int pages_per_zspage;
 
+	/*
+	 * A huge class holds one object per zspage. Its objects have no
+	 * room for a handle, which is kept in first_page->private instead.
+	 */
+	bool huge;
+
 	spinlock_t lock;
 
 	/* stats */
 	u64 pages_allocated;
+	unsigned long stats[NR_ZS_STAT_TYPE];
 
 	struct page *fullness_list[_ZS_NR_FULLNESS_GROUPS];
 };
@@ -141,8 +177,12 @@ struct size_class {
  * This must be power of 2 and less than or equal to ZS_ALIGN
  */
 struct link_free {
-	/* Handle of next free chunk (encodes <PFN, obj_idx>) */
-	void *next;
+	union {
+		/* Location of next free chunk (encodes <PFN, obj_idx>) */
+		void *next;
+		/* Handle of an allocated object, with OBJ_ALLOCATED_TAG */
+		unsigned long handle;
+	};
 };
 
 struct zs_pool {
@@ -150,6 +190,18 @@ struct zs_pool {
 
 	gfp_t flags;	/* allocation flags used when growing pool */
 	const char *name;
+
+	/* sum of size_class pages_allocated, readable without class locks */
+	atomic_long_t pages_allocated;
+	/* pages freed by zs_compact() over the pool's lifetime */
+	atomic_long_t pages_compacted;
+
+	/* compacts the pool when the VM is short of memory */
+	struct shrinker shrinker;
+
+#ifdef CONFIG_ZSMALLOC_STAT
+	struct dentry *stat_dentry;
+#endif
 };
 
 #endif
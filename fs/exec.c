@@ -968,6 +968,8 @@ static int de_thread(struct task_struct *tsk)
 		leader->exit_state = EXIT_DEAD;
 		write_unlock_irq(&tasklist_lock);
 
+		/* the old leader leaves the lowmemorykiller index when freed */
+		lowmem_task_update(tsk);
 		release_task(leader);
 	}
 
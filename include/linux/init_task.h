@@ -37,6 +37,13 @@ extern struct fs_struct init_fs;
 #define INIT_CPUSET_SEQ
 #endif
 
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+#define INIT_LMK_NODE(tsk)						\
+	.lmk_node	= LIST_HEAD_INIT(tsk.lmk_node),
+#else
+#define INIT_LMK_NODE(tsk)
+#endif
+
 #define INIT_SIGNALS(sig) {						\
 	.nr_threads	= 1,						\
 	.wait_chldexit	= __WAIT_QUEUE_HEAD_INITIALIZER(sig.wait_chldexit),\
@@ -210,6 +217,7 @@ extern struct task_group root_task_group;
 	INIT_TRACE_RECURSION						\
 	INIT_TASK_RCU_PREEMPT(tsk)					\
 	INIT_CPUSET_SEQ							\
+	INIT_LMK_NODE(tsk)						\
 }
 
 
@@ -71,6 +71,15 @@ extern unsigned long badness(struct task_struct *p, struct mem_cgroup *mem,
 
 extern struct task_struct *find_lock_task_mm(struct task_struct *p);
 
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+/* re-file a process in the lowmemorykiller's per-oom_adj index */
+extern void lowmem_task_update(struct task_struct *tsk);
+#else
+static inline void lowmem_task_update(struct task_struct *tsk)
+{
+}
+#endif
+
 /* sysctls */
 extern int sysctl_oom_dump_tasks;
 extern int sysctl_oom_kill_allocating_task;
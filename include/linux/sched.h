@@ -1341,6 +1341,11 @@ struct task_struct {
 	/* PID/PID hash table linkage. */
 	struct pid_link pids[PIDTYPE_MAX];
 	struct list_head thread_group;
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+	/* group leaders only: lowmemorykiller oom_adj bucket linkage */
+	struct list_head lmk_node;
+	unsigned int lmk_seq;
+#endif
 
 	struct completion *vfork_done;		/* for vfork() */
 	int __user *set_child_tid;		/* CLONE_CHILD_SETTID */
@@ -0,0 +1,20 @@
+#ifndef __LINUX_VMPRESSURE_H
+#define __LINUX_VMPRESSURE_H
+
+#include <linux/types.h>
+#include <linux/gfp.h>
+
+struct notifier_block;
+
+/*
+ * Every vmpressure_win pages scanned by global reclaim, the notifier chain
+ * is called with the pressure over that window as the action: 0 when
+ * everything scanned was reclaimed, 100 when nothing was.
+ */
+extern void vmpressure(gfp_t gfp, unsigned long scanned,
+		       unsigned long reclaimed);
+
+extern int vmpressure_notifier_register(struct notifier_block *nb);
+extern int vmpressure_notifier_unregister(struct notifier_block *nb);
+
+#endif /* __LINUX_VMPRESSURE_H */
@@ -0,0 +1,163 @@
+/*
+ *  LZ4 Compressor
+ *
+ *  Greedy single pass compressor producing the LZ4 block format
+ *  (http://code.google.com/p/lz4/). It trades some ratio against LZO
+ *  for considerably faster compression of page sized buffers.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/lz4.h>
+#include <asm/unaligned.h>
+#include "lz4defs.h"
+
+static inline u32 lz4_hash(const unsigned char *p)
+{
+	return (get_unaligned_le32(p) * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+static inline unsigned char *lz4_put_length(unsigned char *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+
+	return op;
+}
+
+int lz4_compress(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len, void *wrkmem)
+{
+	u32 *hash_table = wrkmem;
+	const unsigned char *ip = src;
+	const unsigned char *anchor = src;
+	const unsigned char * const iend = src + src_len;
+	const unsigned char * const mflimit = iend - MFLIMIT;
+	const unsigned char * const matchlimit = iend - LASTLITERALS;
+	const unsigned char *ref;
+	unsigned char *op = dst;
+	unsigned char *token;
+	size_t len;
+	u32 h;
+
+	/* input too small, no compression (all literals) */
+	if (src_len < MFLIMIT + 1)
+		goto last_literals;
+
+	memset(hash_table, 0, LZ4_MEM_COMPRESS);
+	hash_table[lz4_hash(ip)] = 0;
+	ip++;
+
+	for (;;) {
+		unsigned int searches = 1 << SKIPSTRENGTH;
+
+		/* find a match, stepping faster over incompressible data */
+		for (;;) {
+			if (unlikely(ip > mflimit))
+				goto last_literals;
+
+			h = lz4_hash(ip);
+			ref = src + hash_table[h];
+			hash_table[h] = ip - src;
+
+			if (ip - ref <= MAX_DISTANCE &&
+			    get_unaligned((const u32 *)ref) ==
+			    get_unaligned((const u32 *)ip))
+				break;
+
+			ip += searches++ >> SKIPSTRENGTH;
+		}
+
+		/* catch up */
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+
+		/* encode literal length and copy literals */
+		len = ip - anchor;
+		token = op++;
+		if (len >= RUN_MASK) {
+			*token = RUN_MASK << ML_BITS;
+			op = lz4_put_length(op, len - RUN_MASK);
+		} else {
+			*token = len << ML_BITS;
+		}
+		memcpy(op, anchor, len);
+		op += len;
+
+next_match:
+		/* encode offset */
+		put_unaligned_le16(ip - ref, op);
+		op += 2;
+
+		/* start counting */
+		ip += MINMATCH;
+		ref += MINMATCH;
+		anchor = ip;
+		while (ip < matchlimit - 3 &&
+		       get_unaligned((const u32 *)ref) ==
+		       get_unaligned((const u32 *)ip)) {
+			ip += 4;
+			ref += 4;
+		}
+		while (ip < matchlimit && *ip == *ref) {
+			ip++;
+			ref++;
+		}
+
+		/* encode match length */
+		len = ip - anchor;
+		if (len >= ML_MASK) {
+			*token |= ML_MASK;
+			op = lz4_put_length(op, len - ML_MASK);
+		} else {
+			*token |= len;
+		}
+
+		anchor = ip;
+		if (ip > mflimit)
+			break;
+
+		/* fill table */
+		hash_table[lz4_hash(ip - 2)] = ip - 2 - src;
+
+		/* test next position */
+		h = lz4_hash(ip);
+		ref = src + hash_table[h];
+		hash_table[h] = ip - src;
+		if (ip - ref <= MAX_DISTANCE &&
+		    get_unaligned((const u32 *)ref) ==
+		    get_unaligned((const u32 *)ip)) {
+			token = op++;
+			*token = 0;
+			goto next_match;
+		}
+
+		ip++;
+	}
+
+last_literals:
+	len = iend - anchor;
+	if (len >= RUN_MASK) {
+		*op++ = RUN_MASK << ML_BITS;
+		op = lz4_put_length(op, len - RUN_MASK);
+	} else {
+		*op++ = len << ML_BITS;
+	}
+	memcpy(op, anchor, len);
+	op += len;
+
+	*dst_len = op - dst;
+	return 0;
+}
+EXPORT_SYMBOL_GPL(lz4_compress);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("LZ4 compressor");
@@ -0,0 +1,35 @@
+/*
+ *  lz4defs.h -- common definitions for the LZ4 block format
+ *
+ *  LZ4 is a byte oriented LZ77 type compression format designed for very
+ *  fast compression and decompression. The format description can be
+ *  found at http://code.google.com/p/lz4/
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ */
+
+/*
+ * A sequence is: token, [literal length bytes], literals, 16 bit little
+ * endian match offset, [match length bytes]. The high nibble of the token
+ * holds the literal length, the low nibble the match length minus MINMATCH;
+ * a nibble of 15 is followed by bytes of 255 terminated by a smaller one.
+ * The last sequence of a block carries literals only.
+ */
+#define MINMATCH	4
+
+#define ML_BITS		4
+#define ML_MASK		((1U << ML_BITS) - 1)
+#define RUN_BITS	(8 - ML_BITS)
+#define RUN_MASK	((1U << RUN_BITS) - 1)
+
+/* the last 5 bytes of a block are always literals */
+#define LASTLITERALS	5
+/* the last match must start at least 12 bytes before the end of block */
+#define MFLIMIT		(8 + MINMATCH)
+
+#define MAX_DISTANCE	((1 << 16) - 1)
+
+/* the compressor gives up faster on data that does not compress */
+#define SKIPSTRENGTH	6
@@ -0,0 +1,91 @@
+/*
+ * mm/vmpressure.c
+ *
+ * Reclaim efficiency as a memory pressure signal.
+ *
+ * Free and cached page counts only say how much memory is left, not how
+ * hard the VM is working to keep it there.  A system that is thrashing
+ * can sit above every watermark while reclaim scans page after page and
+ * frees almost none of them.  The ratio of pages reclaimed to pages
+ * scanned catches that: it collapses long before free memory does.
+ *
+ * Released under the GPL, see the file COPYING for details.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/notifier.h>
+#include <linux/spinlock.h>
+#include <linux/swap.h>
+#include <linux/vmpressure.h>
+
+/*
+ * Pages to scan before reporting.  Smaller windows react faster but
+ * report noise; 512 pages (2MB with 4K pages) is a few shrink_zone()
+ * passes.
+ */
+static const unsigned long vmpressure_win = SWAP_CLUSTER_MAX * 16;
+
+static DEFINE_SPINLOCK(vmpressure_lock);
+static unsigned long vmpressure_scanned;
+static unsigned long vmpressure_reclaimed;
+
+static ATOMIC_NOTIFIER_HEAD(vmpressure_notifier);
+
+int vmpressure_notifier_register(struct notifier_block *nb)
+{
+	return atomic_notifier_chain_register(&vmpressure_notifier, nb);
+}
+EXPORT_SYMBOL_GPL(vmpressure_notifier_register);
+
+int vmpressure_notifier_unregister(struct notifier_block *nb)
+{
+	return atomic_notifier_chain_unregister(&vmpressure_notifier, nb);
+}
+EXPORT_SYMBOL_GPL(vmpressure_notifier_unregister);
+
+static unsigned long vmpressure_calc(unsigned long scanned,
+				     unsigned long reclaimed)
+{
+	/* reclaim can free more than it scanned, e.g. by writeback */
+	if (reclaimed >= scanned)
+		return 0;
+	return 100 - reclaimed * 100 / scanned;
+}
+
+/**
+ * vmpressure() - account a reclaim pass
+ * @gfp: reclaimer's gfp mask
+ * @scanned: pages scanned by this pass
+ * @reclaimed: pages reclaimed by this pass
+ *
+ * Called from shrink_zone() for global reclaim.  Notifiers run under
+ * vmpressure_lock, one window at a time, so they must be quick and must
+ * not sleep.
+ */
+void vmpressure(gfp_t gfp, unsigned long scanned, unsigned long reclaimed)
+{
+	unsigned long pressure;
+
+	/*
+	 * Reclaim that can't do IO or touch the filesystem can only take
+	 * the easy pages; its efficiency says little about the system.
+	 */
+	if (!(gfp & (__GFP_IO | __GFP_FS)))
+		return;
+	if (!scanned)
+		return;
+
+	spin_lock(&vmpressure_lock);
+	vmpressure_scanned += scanned;
+	vmpressure_reclaimed += reclaimed;
+	if (vmpressure_scanned >= vmpressure_win) {
+		pressure = vmpressure_calc(vmpressure_scanned,
+					   vmpressure_reclaimed);
+		vmpressure_scanned = 0;
+		vmpressure_reclaimed = 0;
+		atomic_notifier_call_chain(&vmpressure_notifier, pressure,
+					   NULL);
+	}
+	spin_unlock(&vmpressure_lock);
+}
@@ -0,0 +1,168 @@
+/*
+ * ashmem pin/unpin microbenchmark
+ *
+ * Released under the GPL version 2 only.
+ *
+ * Creates an ashmem region, fragments it into many unpinned ranges the
+ * way a page-granular cache does, and times ASHMEM_PIN, ASHMEM_UNPIN and
+ * ASHMEM_GET_PIN_STATUS on random pages. The run is repeated for a
+ * growing number of ranges, so the per-call cost shows how the range
+ * lookup scales:
+ *
+ *	ashmem-bench [-p max pages] [-n calls per measurement] [-d device]
+ *
+ * The pages are never touched, so the region costs no memory.
+ */
+
+/* Linux */
+#include <linux/types.h>
+#include <linux/ashmem.h>
+
+/* Unix */
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* C */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char *device = "/dev/ashmem";
+static unsigned int max_pages = 65536;
+static unsigned int nr_calls = 100000;
+static long page_size;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(const char *what)
+{
+	fprintf(stderr, "ashmem-bench: %s: %s\n", what, strerror(errno));
+	exit(1);
+}
+
+static int pin_op(int fd, int cmd, unsigned int page, unsigned int count)
+{
+	struct ashmem_pin pin = {
+		.offset = page * page_size,
+		.len = count * page_size,
+	};
+	int ret;
+
+	ret = ioctl(fd, cmd, &pin);
+	if (ret < 0)
+		die("pin ioctl");
+	return ret;
+}
+
+/*
+ * Unpins every other page of the first 'pages' pages, which leaves
+ * pages / 2 separate unpinned ranges that can never merge.
+ */
+static int setup(unsigned int pages)
+{
+	unsigned int i;
+	void *map;
+	int fd;
+
+	fd = open(device, O_RDWR);
+	if (fd < 0)
+		die(device);
+	if (ioctl(fd, ASHMEM_SET_SIZE, (size_t) pages * page_size) < 0)
+		die("ASHMEM_SET_SIZE");
+	/* the backing file only exists once the region is mapped */
+	map = mmap(NULL, (size_t) pages * page_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		die("mmap");
+	munmap(map, (size_t) pages * page_size);
+
+	for (i = 0; i < pages; i += 2)
+		pin_op(fd, ASHMEM_UNPIN, i, 1);
+
+	return fd;
+}
+
+/* random even page, i.e. one that starts out unpinned */
+static unsigned int random_page(unsigned int pages)
+{
+	return (rand() % (pages / 2)) * 2;
+}
+
+static void run(unsigned int pages)
+{
+	double start, pin_unpin, status;
+	unsigned int i;
+	int fd;
+
+	fd = setup(pages);
+
+	/* pin a lone unpinned page, then unpin it again */
+	start = now();
+	for (i = 0; i < nr_calls; i++) {
+		unsigned int page = random_page(pages);
+
+		pin_op(fd, ASHMEM_PIN, page, 1);
+		pin_op(fd, ASHMEM_UNPIN, page, 1);
+	}
+	pin_unpin = (now() - start) / (2.0 * nr_calls);
+
+	start = now();
+	for (i = 0; i < nr_calls; i++)
+		pin_op(fd, ASHMEM_GET_PIN_STATUS, random_page(pages) + 1, 1);
+	status = (now() - start) / nr_calls;
+
+	printf("%10u %10.0f %10.0f\n", pages / 2, pin_unpin * 1e9,
+	       status * 1e9);
+
+	close(fd);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: ashmem-bench [-p max pages] "
+		"[-n calls per measurement] [-d device]\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int pages;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "p:n:d:")) != -1) {
+		switch (opt) {
+		case 'p':
+			max_pages = atoi(optarg);
+			break;
+		case 'n':
+			nr_calls = atoi(optarg);
+			break;
+		case 'd':
+			device = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (max_pages < 16 || !nr_calls)
+		usage();
+
+	page_size = sysconf(_SC_PAGESIZE);
+	srand(1);
+
+	printf("%10s %10s %10s\n", "ranges", "pin ns", "status ns");
+	for (pages = 16; pages <= max_pages; pages *= 4)
+		run(pages);
+
+	return 0;
+}
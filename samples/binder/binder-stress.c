@@ -0,0 +1,479 @@
+/*
+ * Binder IPC stress test
+ *
+ * Released under the GPL version 2 only.
+ *
+ * Runs N independent client/server process pairs, each pair doing
+ * synchronous ping-pong transactions over /dev/binder, and reports the
+ * aggregate throughput and the call latency distribution. The pairs
+ * share nothing but the driver, so the numbers show how well binder
+ * transactions between unrelated processes scale across CPUs.
+ *
+ * The test process itself becomes the context manager and brokers the
+ * handles, so it must be run while no servicemanager is registered:
+ *
+ *	binder-stress [-p pairs] [-n calls] [-s payload bytes] [-d device]
+ */
+
+#define _GNU_SOURCE
+
+/* Linux */
+#include <linux/types.h>
+
+/* Unix */
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+/* C */
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "binder.h"
+
+#define MAP_SIZE	(128 * 1024)
+
+enum {
+	CODE_REGISTER = 1,	/* server -> manager: u32 pair, binder object */
+	CODE_LOOKUP,		/* client -> manager: u32 pair */
+	CODE_PING,		/* client -> server: payload */
+};
+
+struct registration {
+	uint32_t pair;
+	struct flat_binder_object obj;
+};
+
+struct txn {
+	uint32_t cmd;
+	struct binder_transaction_data tr;
+} __attribute__((packed));
+
+static const char *device = "/dev/binder";
+static int nr_pairs = 4;
+static int nr_calls = 10000;
+static int payload = 128;
+
+/* per-call latencies and the run time of each client, shared with main */
+static uint32_t *latencies;
+static double *elapsed;
+
+static int service_object;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(const char *what)
+{
+	fprintf(stderr, "binder-stress[%d]: %s: %s\n", getpid(), what,
+		strerror(errno));
+	exit(1);
+}
+
+static int binder_setup(void)
+{
+	int fd;
+
+	fd = open(device, O_RDWR);
+	if (fd < 0)
+		die(device);
+	if (mmap(NULL, MAP_SIZE, PROT_READ, MAP_PRIVATE, fd, 0) == MAP_FAILED)
+		die("mmap");
+	return fd;
+}
+
+static void binder_write(int fd, const void *data, size_t len)
+{
+	struct binder_write_read bwr;
+
+	memset(&bwr, 0, sizeof(bwr));
+	bwr.write_size = len;
+	bwr.write_buffer = (unsigned long)data;
+	if (ioctl(fd, BINDER_WRITE_READ, &bwr) < 0)
+		die("BINDER_WRITE_READ write");
+}
+
+static void binder_cmd(int fd, uint32_t cmd, uint32_t arg)
+{
+	uint32_t buf[2] = { cmd, arg };
+
+	binder_write(fd, buf, cmd == BC_ENTER_LOOPER ? 4 : 8);
+}
+
+/*
+ * Read from the driver until a BR_TRANSACTION or BR_REPLY arrives and
+ * copy its transaction data to @tr. Reference count requests for our
+ * own objects are acknowledged on the way. Returns the command, or
+ * BR_DEAD_REPLY/BR_FAILED_REPLY if the call failed.
+ */
+static uint32_t binder_wait(int fd, struct binder_transaction_data *tr)
+{
+	uint32_t buf[128];
+
+	for (;;) {
+		struct binder_write_read bwr;
+		char *ptr, *end;
+
+		memset(&bwr, 0, sizeof(bwr));
+		bwr.read_size = sizeof(buf);
+		bwr.read_buffer = (unsigned long)buf;
+		if (ioctl(fd, BINDER_WRITE_READ, &bwr) < 0) {
+			if (errno == EINTR)
+				continue;
+			die("BINDER_WRITE_READ read");
+		}
+
+		ptr = (char *)buf;
+		end = ptr + bwr.read_consumed;
+		while (ptr < end) {
+			uint32_t cmd = *(uint32_t *)ptr;
+
+			ptr += sizeof(uint32_t);
+			switch (cmd) {
+			case BR_NOOP:
+			case BR_TRANSACTION_COMPLETE:
+			case BR_SPAWN_LOOPER:
+				break;
+			case BR_INCREFS:
+			case BR_ACQUIRE: {
+				struct {
+					uint32_t cmd;
+					struct binder_ptr_cookie pc;
+				} __attribute__((packed)) ack;
+
+				ack.cmd = cmd == BR_INCREFS ?
+					BC_INCREFS_DONE : BC_ACQUIRE_DONE;
+				memcpy(&ack.pc, ptr, sizeof(ack.pc));
+				binder_write(fd, &ack, sizeof(ack));
+				ptr += sizeof(struct binder_ptr_cookie);
+				break;
+			}
+			case BR_RELEASE:
+			case BR_DECREFS:
+				ptr += sizeof(struct binder_ptr_cookie);
+				break;
+			case BR_DEAD_BINDER:
+			case BR_CLEAR_DEATH_NOTIFICATION_DONE:
+				ptr += sizeof(void *);
+				break;
+			case BR_TRANSACTION:
+			case BR_REPLY:
+				memcpy(tr, ptr, sizeof(*tr));
+				return cmd;
+			case BR_DEAD_REPLY:
+			case BR_FAILED_REPLY:
+				return cmd;
+			default:
+				fprintf(stderr, "binder-stress: unexpected "
+					"return 0x%x\n", cmd);
+				exit(1);
+			}
+		}
+	}
+}
+
+static void binder_free(int fd, const void *buffer)
+{
+	struct {
+		uint32_t cmd;
+		const void *buffer;
+	} __attribute__((packed)) cmd = { BC_FREE_BUFFER, buffer };
+
+	binder_write(fd, &cmd, sizeof(cmd));
+}
+
+static void fill_txn(struct txn *t, uint32_t cmd, uint32_t handle,
+		     uint32_t code, const void *data, size_t size,
+		     const size_t *offsets, size_t offsets_size)
+{
+	memset(t, 0, sizeof(*t));
+	t->cmd = cmd;
+	t->tr.target.handle = handle;
+	t->tr.code = code;
+	t->tr.data_size = size;
+	t->tr.data.ptr.buffer = data;
+	t->tr.offsets_size = offsets_size;
+	t->tr.data.ptr.offsets = offsets;
+}
+
+/* Synchronous call; the reply is left in @reply and must be freed */
+static uint32_t binder_call(int fd, uint32_t handle, uint32_t code,
+			    const void *data, size_t size,
+			    const size_t *offsets, size_t offsets_size,
+			    struct binder_transaction_data *reply)
+{
+	struct txn t;
+	uint32_t ret;
+
+	fill_txn(&t, BC_TRANSACTION, handle, code, data, size,
+		 offsets, offsets_size);
+	binder_write(fd, &t, sizeof(t));
+	ret = binder_wait(fd, reply);
+	if (ret == BR_TRANSACTION) {
+		fprintf(stderr, "binder-stress: unexpected incoming call\n");
+		exit(1);
+	}
+	return ret;
+}
+
+/* Reply to the transaction @tr and free its buffer in the same write */
+static void binder_reply(int fd, struct binder_transaction_data *tr,
+			 const void *data, size_t size,
+			 const size_t *offsets, size_t offsets_size)
+{
+	struct {
+		struct txn reply;
+		uint32_t free_cmd;
+		const void *buffer;
+	} __attribute__((packed)) cmd;
+
+	fill_txn(&cmd.reply, BC_REPLY, 0, 0, data, size,
+		 offsets, offsets_size);
+	cmd.free_cmd = BC_FREE_BUFFER;
+	cmd.buffer = tr->data.ptr.buffer;
+	binder_write(fd, &cmd, sizeof(cmd));
+}
+
+static void run_manager(int fd)
+{
+	uint32_t *handles = calloc(nr_pairs, sizeof(*handles));
+	int found = 0;
+
+	if (!handles)
+		die("calloc");
+
+	binder_cmd(fd, BC_ENTER_LOOPER, 0);
+	while (found < nr_pairs) {
+		struct binder_transaction_data tr;
+		const uint32_t *pair;
+
+		if (binder_wait(fd, &tr) != BR_TRANSACTION)
+			continue;
+		pair = tr.data.ptr.buffer;
+		if (tr.data_size < sizeof(*pair) || *pair >= (uint32_t)nr_pairs) {
+			binder_reply(fd, &tr, NULL, 0, NULL, 0);
+			continue;
+		}
+
+		if (tr.code == CODE_REGISTER &&
+		    tr.data_size >= sizeof(struct registration)) {
+			const struct registration *reg = tr.data.ptr.buffer;
+
+			handles[*pair] = reg->obj.handle;
+			/* hold on to the handle once the buffer is freed */
+			binder_cmd(fd, BC_ACQUIRE, handles[*pair]);
+			binder_reply(fd, &tr, NULL, 0, NULL, 0);
+		} else if (tr.code == CODE_LOOKUP && handles[*pair]) {
+			struct flat_binder_object obj;
+			size_t offset = 0;
+
+			memset(&obj, 0, sizeof(obj));
+			obj.type = BINDER_TYPE_HANDLE;
+			obj.handle = handles[*pair];
+			binder_reply(fd, &tr, &obj, sizeof(obj), &offset,
+				     sizeof(offset));
+			found++;
+		} else {
+			/* not registered yet, the client retries */
+			binder_reply(fd, &tr, NULL, 0, NULL, 0);
+		}
+	}
+	free(handles);
+}
+
+static void run_server(int pair)
+{
+	int fd = binder_setup();
+	struct binder_transaction_data tr;
+	struct registration reg;
+	size_t offset = offsetof(struct registration, obj);
+
+	memset(&reg, 0, sizeof(reg));
+	reg.pair = pair;
+	reg.obj.type = BINDER_TYPE_BINDER;
+	reg.obj.binder = &service_object;
+	if (binder_call(fd, 0, CODE_REGISTER, &reg, sizeof(reg),
+			&offset, sizeof(offset), &tr) != BR_REPLY)
+		die("register");
+	binder_free(fd, tr.data.ptr.buffer);
+
+	binder_cmd(fd, BC_ENTER_LOOPER, 0);
+	for (;;) {
+		if (binder_wait(fd, &tr) != BR_TRANSACTION)
+			continue;
+		/* echo the payload back */
+		binder_reply(fd, &tr, tr.data.ptr.buffer, tr.data_size,
+			     NULL, 0);
+	}
+}
+
+static void run_client(int pair)
+{
+	int fd = binder_setup();
+	struct binder_transaction_data tr;
+	uint32_t id = pair;
+	uint32_t handle = 0;
+	char *data;
+	double start;
+	int i;
+
+	while (!handle) {
+		const struct flat_binder_object *obj;
+
+		if (binder_call(fd, 0, CODE_LOOKUP, &id, sizeof(id),
+				NULL, 0, &tr) != BR_REPLY)
+			die("lookup");
+		obj = tr.data.ptr.buffer;
+		if (tr.data_size >= sizeof(*obj)) {
+			handle = obj->handle;
+			binder_cmd(fd, BC_ACQUIRE, handle);
+		}
+		binder_free(fd, tr.data.ptr.buffer);
+		if (!handle)
+			usleep(1000);
+	}
+
+	data = calloc(1, payload);
+	if (!data)
+		die("calloc");
+
+	start = now();
+	for (i = 0; i < nr_calls; i++) {
+		double t0 = now();
+
+		if (binder_call(fd, handle, CODE_PING, data, payload,
+				NULL, 0, &tr) != BR_REPLY)
+			die("ping");
+		binder_free(fd, tr.data.ptr.buffer);
+		latencies[(size_t)pair * nr_calls + i] = (now() - t0) * 1e9;
+	}
+	elapsed[pair] = now() - start;
+	exit(0);
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report(void)
+{
+	size_t total = (size_t)nr_pairs * nr_calls;
+	double longest = 0;
+	int i;
+
+	for (i = 0; i < nr_pairs; i++)
+		if (elapsed[i] > longest)
+			longest = elapsed[i];
+
+	qsort(latencies, total, sizeof(*latencies), cmp_u32);
+	printf("pairs %d calls %d payload %d\n", nr_pairs, nr_calls, payload);
+	printf("throughput: %.0f calls/s\n", total / longest);
+	printf("latency us: p50 %.1f p90 %.1f p99 %.1f max %.1f\n",
+	       latencies[total / 2] / 1e3,
+	       latencies[total * 9 / 10] / 1e3,
+	       latencies[total * 99 / 100] / 1e3,
+	       latencies[total - 1] / 1e3);
+}
+
+int main(int argc, char **argv)
+{
+	pid_t *servers, *clients;
+	int fd, opt, i, status, failed = 0;
+
+	while ((opt = getopt(argc, argv, "p:n:s:d:")) != -1) {
+		switch (opt) {
+		case 'p':
+			nr_pairs = atoi(optarg);
+			break;
+		case 'n':
+			nr_calls = atoi(optarg);
+			break;
+		case 's':
+			payload = atoi(optarg);
+			break;
+		case 'd':
+			device = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-p pairs] [-n calls] "
+				"[-s payload] [-d device]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (nr_pairs <= 0 || nr_calls <= 0 || payload < 0 ||
+	    payload > MAP_SIZE / 4) {
+		fprintf(stderr, "binder-stress: bad arguments\n");
+		return 1;
+	}
+
+	latencies = mmap(NULL, (size_t)nr_pairs * nr_calls * sizeof(uint32_t),
+			 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+			 -1, 0);
+	elapsed = mmap(NULL, nr_pairs * sizeof(double),
+		       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+		       -1, 0);
+	servers = calloc(nr_pairs, sizeof(pid_t));
+	clients = calloc(nr_pairs, sizeof(pid_t));
+	if (latencies == MAP_FAILED || elapsed == MAP_FAILED ||
+	    !servers || !clients)
+		die("alloc");
+
+	fd = binder_setup();
+	if (ioctl(fd, BINDER_SET_CONTEXT_MGR, 0) < 0)
+		die("BINDER_SET_CONTEXT_MGR");
+
+	for (i = 0; i < 2 * nr_pairs; i++) {
+		pid_t pid = fork();
+
+		if (pid < 0)
+			die("fork");
+		if (!pid) {
+			/* the inherited fd belongs to the manager */
+			close(fd);
+			if (i < nr_pairs)
+				run_server(i);
+			else
+				run_client(i - nr_pairs);
+		}
+		if (i < nr_pairs)
+			servers[i] = pid;
+		else
+			clients[i - nr_pairs] = pid;
+	}
+
+	run_manager(fd);
+
+	for (i = 0; i < nr_pairs; i++) {
+		if (waitpid(clients[i], &status, 0) < 0 ||
+		    !WIFEXITED(status) || WEXITSTATUS(status))
+			failed++;
+	}
+	for (i = 0; i < nr_pairs; i++) {
+		kill(servers[i], SIGKILL);
+		waitpid(servers[i], NULL, 0);
+	}
+	if (failed) {
+		fprintf(stderr, "binder-stress: %d clients failed\n", failed);
+		return 1;
+	}
+
+	report();
+	return 0;
+}
@@ -0,0 +1,279 @@
+/*
+ * zsmalloc object mapping benchmark
+ *
+ * Released under the GPL version 2 only.
+ *
+ * zsmalloc maps an object that lies within one page with kmap_atomic().
+ * An object that spans two pages is either copied through a per-cpu
+ * buffer or mapped through a per-cpu VM area, depending on
+ * CONFIG_ZSMALLOC_PGTABLE_MAPPING. Which is cheaper depends on the CPU,
+ * and it shows up directly in zram swap-in latency.
+ *
+ * On load, this module times both strategies on a pair of pages, then
+ * times zs_map_object()/zs_unmap_object() through a real pool, and
+ * prints the results. The module then fails to load on purpose, so it
+ * can simply be inserted again for another run:
+ *
+ *	insmod zsmapbench.ko [iterations=N]
+ *	dmesg | grep zsmapbench
+ */
+
+#define pr_fmt(fmt) "zsmapbench: " fmt
+
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/kernel.h>
+#include <linux/highmem.h>
+#include <linux/vmalloc.h>
+#include <linux/hrtimer.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/gfp.h>
+
+#include "../../drivers/staging/zsmalloc/zsmalloc.h"
+
+static unsigned int iterations = 100000;
+module_param(iterations, uint, 0444);
+MODULE_PARM_DESC(iterations, "map/unmap cycles per measurement");
+
+/* zs_malloc() sizes: within a page, and sizes whose classes span pages */
+static const size_t bench_sizes[] = { 256, 1536, 2400, 3000 };
+
+#define BENCH_OBJS	64
+
+static u64 ns_per_op(ktime_t start, ktime_t end, unsigned int ops)
+{
+	u64 ns = ktime_to_ns(ktime_sub(end, start));
+
+	do_div(ns, ops);
+	return ns;
+}
+
+/* Copy strategy: bounce @size bytes straddling @pages through @buf */
+static void copy_in(struct page *pages[2], char *buf, int off, int size)
+{
+	int first = PAGE_SIZE - off;
+	void *addr;
+
+	addr = kmap_atomic(pages[0]);
+	memcpy(buf, addr + off, first);
+	kunmap_atomic(addr);
+	addr = kmap_atomic(pages[1]);
+	memcpy(buf + first, addr, size - first);
+	kunmap_atomic(addr);
+}
+
+static void copy_out(struct page *pages[2], char *buf, int off, int size)
+{
+	int first = PAGE_SIZE - off;
+	void *addr;
+
+	addr = kmap_atomic(pages[0]);
+	memcpy(addr + off, buf, first);
+	kunmap_atomic(addr);
+	addr = kmap_atomic(pages[1]);
+	memcpy(addr, buf + first, size - first);
+	kunmap_atomic(addr);
+}
+
+static int bench_strategies(void)
+{
+	struct page *pages[2] = { NULL, NULL };
+	struct page **page_array;
+	struct vm_struct *vm = NULL;
+	char *buf = NULL;
+	volatile char sink;
+	ktime_t start, end;
+	unsigned int i;
+	int size, off, ret = -ENOMEM;
+
+	pages[0] = alloc_page(GFP_KERNEL | __GFP_HIGHMEM);
+	pages[1] = alloc_page(GFP_KERNEL | __GFP_HIGHMEM);
+	buf = (char *)__get_free_page(GFP_KERNEL);
+	vm = alloc_vm_area(PAGE_SIZE * 2);
+	if (!pages[0] || !pages[1] || !buf || !vm)
+		goto out;
+
+	pr_info("%-24s %6s %10s\n", "strategy", "size", "ns/op");
+
+	for (size = 512; size <= PAGE_SIZE; size *= 2) {
+		/* straddle the page boundary evenly */
+		off = PAGE_SIZE - size / 2;
+
+		preempt_disable();
+		start = ktime_get();
+		for (i = 0; i < iterations; i++) {
+			copy_in(pages, buf, off, size);
+			sink = buf[0];
+		}
+		end = ktime_get();
+		preempt_enable();
+		pr_info("%-24s %6d %10llu\n", "copy (read only)", size,
+			ns_per_op(start, end, iterations));
+
+		preempt_disable();
+		start = ktime_get();
+		for (i = 0; i < iterations; i++) {
+			copy_in(pages, buf, off, size);
+			buf[0]++;
+			copy_out(pages, buf, off, size);
+		}
+		end = ktime_get();
+		preempt_enable();
+		pr_info("%-24s %6d %10llu\n", "copy (read write)", size,
+			ns_per_op(start, end, iterations));
+
+		preempt_disable();
+		start = ktime_get();
+		for (i = 0; i < iterations; i++) {
+			char *addr;
+
+			page_array = pages;
+			if (map_vm_area(vm, PAGE_KERNEL, &page_array)) {
+				preempt_enable();
+				ret = -EFAULT;
+				goto out;
+			}
+			addr = vm->addr;
+			addr[off]++;
+			unmap_kernel_range((unsigned long)vm->addr,
+					PAGE_SIZE * 2);
+		}
+		end = ktime_get();
+		preempt_enable();
+		pr_info("%-24s %6d %10llu\n", "map_vm_area", size,
+			ns_per_op(start, end, iterations));
+	}
+
+	preempt_disable();
+	start = ktime_get();
+	for (i = 0; i < iterations; i++) {
+		char *addr = kmap_atomic(pages[0]);
+
+		addr[0]++;
+		kunmap_atomic(addr);
+	}
+	end = ktime_get();
+	preempt_enable();
+	pr_info("%-24s %6s %10llu\n", "kmap_atomic (one page)", "-",
+		ns_per_op(start, end, iterations));
+
+	(void)sink;
+	ret = 0;
+out:
+	if (vm)
+		free_vm_area(vm);
+	free_page((unsigned long)buf);
+	if (pages[1])
+		__free_page(pages[1]);
+	if (pages[0])
+		__free_page(pages[0]);
+	return ret;
+}
+
+static u64 bench_pool_size(struct zs_pool *pool, unsigned long *handles,
+				size_t size, enum zs_mapmode mm)
+{
+	unsigned int i, n;
+	ktime_t start, end;
+
+	start = ktime_get();
+	for (i = 0; i < iterations; i += n) {
+		for (n = 0; n < BENCH_OBJS; n++) {
+			char *obj = zs_map_object(pool, handles[n], mm);
+
+			if (mm != ZS_MM_RO)
+				obj[size - 1]++;
+			zs_unmap_object(pool, handles[n]);
+		}
+		cond_resched();
+	}
+	end = ktime_get();
+
+	return ns_per_op(start, end, i);
+}
+
+static int bench_pool(void)
+{
+	struct zs_pool *pool;
+	unsigned long *handles;
+	int i, j, ret = 0;
+
+	handles = kcalloc(BENCH_OBJS, sizeof(*handles), GFP_KERNEL);
+	if (!handles)
+		return -ENOMEM;
+
+	pool = zs_create_pool("zsmapbench", GFP_KERNEL | __GFP_HIGHMEM);
+	if (!pool) {
+		kfree(handles);
+		return -ENOMEM;
+	}
+
+#ifdef CONFIG_ZSMALLOC_PGTABLE_MAPPING
+	pr_info("zsmalloc maps spanning objects with map_vm_area\n");
+#else
+	pr_info("zsmalloc copies spanning objects\n");
+#endif
+	pr_info("%-24s %6s %10s\n", "zs_map_object", "size", "ns/op");
+
+	for (i = 0; i < ARRAY_SIZE(bench_sizes); i++) {
+		size_t size = bench_sizes[i];
+
+		for (j = 0; j < BENCH_OBJS; j++) {
+			handles[j] = zs_malloc(pool, size);
+			if (!handles[j]) {
+				ret = -ENOMEM;
+				break;
+			}
+		}
+
+		if (!ret) {
+			pr_info("%-24s %6zu %10llu\n", "read only", size,
+				bench_pool_size(pool, handles, size,
+						ZS_MM_RO));
+			pr_info("%-24s %6zu %10llu\n", "write only", size,
+				bench_pool_size(pool, handles, size,
+						ZS_MM_WO));
+			pr_info("%-24s %6zu %10llu\n", "read write", size,
+				bench_pool_size(pool, handles, size,
+						ZS_MM_RW));
+		}
+
+		for (j = 0; j < BENCH_OBJS; j++) {
+			zs_free(pool, handles[j]);
+			handles[j] = 0;
+		}
+		if (ret)
+			break;
+	}
+
+	zs_destroy_pool(pool);
+	kfree(handles);
+	return ret;
+}
+
+static int __init zsmapbench_init(void)
+{
+	int ret;
+
+	if (!iterations)
+		return -EINVAL;
+
+	ret = bench_strategies();
+	if (!ret)
+		ret = bench_pool();
+	if (ret)
+		return ret;
+
+	/* nothing to keep loaded, see the comment at the top */
+	return -EAGAIN;
+}
+
+static void __exit zsmapbench_exit(void)
+{
+}
+
+module_init(zsmapbench_init);
+module_exit(zsmapbench_exit);
+MODULE_LICENSE("GPL");